@@ -0,0 +1,96 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+
+   bgtask.c: Background jobs run while the bus is idle
+
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "config.h"
+#include "d64ops.h"
+#include "fatops.h"
+#include "bgtask.h"
+
+/*
+  Work that does not have to be done while a bus transaction is in
+  progress is scheduled here and run from the idle loop of the bus
+  that is active. A job does a bounded amount of work per call (at
+  most a few sector accesses) and returns true if it must be called
+  again. The idle loop checks for ATN between two calls, so a bus
+  transaction is delayed by at most one slice.
+*/
+
+static bool bam_commit_job(void) {
+  d64_bam_commit();
+  return false;
+}
+
+static bool (* const jobs[BGTASK_COUNT])(void) = {
+  bam_commit_job,
+#ifdef CONFIG_FAT_FREECOUNT
+  fat_freecount_job,
+#endif
+};
+
+static uint8_t pending;
+
+/**
+ * bgtask_schedule - request a background job
+ * @task: job to run
+ *
+ * This function marks @task as pending. Scheduling a job that
+ * is already pending has no effect.
+ */
+void bgtask_schedule(bgtask_t task) {
+  pending |= 1 << task;
+}
+
+/**
+ * bgtask_cancel - drop a pending background job
+ * @task: job to drop
+ */
+void bgtask_cancel(bgtask_t task) {
+  pending &= (uint8_t)~(1 << task);
+}
+
+/**
+ * bgtask_run - run one slice of a background job
+ *
+ * This function calls the pending job with the highest priority
+ * once. It must only be called while the bus is idle. Returns
+ * true if a job was run, false if nothing is pending.
+ */
+bool bgtask_run(void) {
+  uint8_t i;
+
+  for (i = 0; i < BGTASK_COUNT; i++) {
+    if (pending & (1 << i)) {
+      if (!jobs[i]())
+        pending &= (uint8_t)~(1 << i);
+      return true;
+    }
+  }
+  return false;
+}
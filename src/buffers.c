@@ -30,6 +30,7 @@
 #include "dirent.h"
 #include "errormsg.h"
 #include "ff.h"
+#include "fileops.h"
 #include "led.h"
 #include "buffers.h"
 
@@ -87,6 +88,8 @@ void buffers_init(void) {
  */
 static void alloc_specific_buffer(uint8_t bufnum) {
   if (!buffers[bufnum].allocated) {
+    /* Restore a borrowed data area, linked buffers depend on their order */
+    buffers[bufnum].data = bufferdata + 256*bufnum;
     /* Clear everything except the data pointer */
     memset(sizeof(uint8_t *)+(char *)&(buffers[bufnum]),0,sizeof(buffer_t)-sizeof(uint8_t *));
     buffers[bufnum].allocated = 1;
@@ -96,6 +99,19 @@ static void alloc_specific_buffer(uint8_t bufnum) {
   }
 }
 
+/**
+ * buffer_data_area - return the data area that belongs to a buffer
+ * @buf: pointer to the buffer
+ *
+ * The data pointer of an allocated buffer may refer to memory that
+ * is borrowed from elsewhere, e.g. the disk image read-ahead. This
+ * function returns the data area in bufferdata that is assigned to
+ * the buffer and restored on the next allocation.
+ */
+uint8_t *buffer_data_area(buffer_t *buf) {
+  return bufferdata + 256 * (buf - buffers);
+}
+
 /**
  * alloc_system_buffer - allocate a buffer for system use
  *
@@ -301,3 +317,112 @@ void mark_buffer_clean(buffer_t *buf) {
       set_dirty_led(0);
   }
 }
+
+/* ------------------------------------------------------------------------- */
+/*  Write-behind                                                             */
+/* ------------------------------------------------------------------------- */
+
+/* Full blocks held back by defer_buffer_write */
+static buffer_t *deferred[WRITE_BEHIND_BLOCKS];
+static uint8_t   deferred_count;
+
+/**
+ * defer_buffer_write - hold back the full data block of a buffer
+ * @buf: buffer that must be flushed
+ *
+ * This function copies the data of buf to a spare buffer and marks buf
+ * as empty, so the bus can keep receiving while the write is postponed
+ * to write_deferred_buffers. One buffer is always left free for the
+ * refill callbacks. Returns true if successful, false if the block must
+ * be written now.
+ */
+bool defer_buffer_write(buffer_t *buf) {
+  buffer_t *spare, *probe;
+  uint8_t olderror;
+
+  /* Only sequential files can be written behind */
+  if (deferred_count == WRITE_BEHIND_BLOCKS || buf->recordlen ||
+      buf->secondary == 15 || buf->refill == directbuffer_refill)
+    return false;
+
+  olderror = current_error;
+  spare = alloc_system_buffer();
+  probe = alloc_system_buffer();
+  free_buffer(probe);
+  if (probe == NULL) {
+    free_buffer(spare);
+    if (current_error != olderror)
+      set_error(olderror);
+    return false;
+  }
+
+  memcpy(spare->data, buf->data, 256);
+  deferred[deferred_count++] = spare;
+
+  buf->mustflush = 0;
+  buf->position  = 2;
+  buf->lastused  = 2;
+  return true;
+}
+
+/**
+ * write_deferred_buffers - write all blocks held back for a buffer
+ * @buf: buffer the blocks belong to
+ *
+ * This function writes the blocks held back by defer_buffer_write
+ * through the refill callback of buf, keeping the data that was
+ * received since then, including whether it must be flushed. All
+ * spare buffers are released. Returns the result of the first failed
+ * refill, which has set the error channel, or 0 if successful.
+ */
+uint8_t write_deferred_buffers(buffer_t *buf) {
+  uint8_t *partial, *spare_data;
+  uint8_t  position, lastused, i;
+  uint8_t  dirty, mustflush;
+  uint8_t  res = 0;
+
+  if (deferred_count == 0)
+    return 0;
+
+  position = buf->position;
+  lastused = buf->lastused;
+  dirty    = buf->dirty;
+  /* A listen that ended on a full block leaves it to the next one */
+  mustflush = buf->mustflush;
+
+  /* Park the partial block in the first spare, its data is written first */
+  partial    = buf->data;
+  spare_data = deferred[0]->data;
+  buf->data  = spare_data;
+  deferred[0]->data = partial;
+
+  for (i = 0; i < deferred_count; i++) {
+    if (i > 0) {
+      memcpy(buf->data, deferred[i]->data, 256);
+      free_buffer(deferred[i]);
+    }
+    if (res)
+      continue;
+
+    buf->position  = 0;
+    buf->lastused  = 255;
+    buf->mustflush = 1;
+    res = buf->refill(buf);
+  }
+
+  /* Swap the data areas back, linked buffers depend on their order */
+  buf->data = partial;
+  deferred[0]->data = spare_data;
+  free_buffer(deferred[0]);
+  deferred_count = 0;
+
+  if (!res) {
+    buf->position  = position;
+    buf->lastused  = lastused;
+    buf->mustflush = mustflush;
+    if (dirty)
+      mark_buffer_dirty(buf);
+  }
+
+  return res;
+}
@@ -27,6 +27,7 @@
 #ifndef BUFFERS_H
 #define BUFFERS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "dirent.h"
 
@@ -146,6 +147,9 @@ void buffers_init(void);
 /* Dummy callback */
 uint8_t callback_dummy(buffer_t *buf);
 
+/* Returns the data area that belongs to a buffer */
+uint8_t *buffer_data_area(buffer_t *buf);
+
 /* Allocates a buffer for internal use */
 buffer_t *alloc_system_buffer(void);
 
@@ -201,6 +205,15 @@ void mark_buffer_dirty(buffer_t *buf);
 /* Mark a buffer as clean */
 void mark_buffer_clean(buffer_t *buf);
 
+/* Number of full blocks that can be written behind the bus transfer */
+#define WRITE_BEHIND_BLOCKS 4
+
+/* Hold back the full block of a write buffer */
+bool defer_buffer_write(buffer_t *buf);
+
+/* Write the blocks held back for a buffer */
+uint8_t write_deferred_buffers(buffer_t *buf);
+
 
 #ifdef __AVR__
 /* AVR-specific hack: Address 1 is r1 which is always zero in C code */
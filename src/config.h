@@ -103,6 +103,11 @@ static inline void late_board_init(void) {
 #  endif
 #endif
 
+#if defined(CONFIG_FAST_SERIAL) && \
+    (!defined(HAVE_FAST_SERIAL) || !defined(CONFIG_HAVE_IEC))
+#  error "CONFIG_FAST_SERIAL enabled on a hardware without fast serial support!"
+#endif
+
 /* ----- Translate CONFIG_RTC_* symbols to HAVE_RTC symbol ----- */
 #if defined(CONFIG_RTC_SOFTWARE) || \
     defined(CONFIG_RTC_PCF8583)  || \
@@ -117,6 +122,11 @@ static inline void late_board_init(void) {
       defined(CONFIG_RTC_DSRTC)  > 1
 #    define NEED_RTCMUX
 #  endif
+
+/* I2C clocks are slow to read, interpolate from the system tick instead */
+#  if defined(CONFIG_RTC_PCF8583) || defined(CONFIG_RTC_DSRTC)
+#    define NEED_RTC_CACHE
+#  endif
 #endif
 
 #endif
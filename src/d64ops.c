@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <string.h>
 #include "config.h"
+#include "bgtask.h"
 #include "buffers.h"
 #include "dirent.h"
 #include "errormsg.h"
@@ -36,6 +37,7 @@
 #include "parser.h"
 #include "progmem.h"
 #include "rtc.h"
+#include "trackcache.h"
 #include "ustring.h"
 #include "wrapops.h"
 #include "d64ops.h"
@@ -91,6 +93,9 @@
 /* used for error info only */
 #define MAX_SECTORS_PER_TRACK 40
 
+/* partition[].freeblocks value if the count must be recalculated */
+#define FREEBLOCKS_UNKNOWN 0xffff
+
 typedef enum { BAM_BITFIELD, BAM_FREECOUNT } bamdata_t;
 
 struct {
@@ -99,10 +104,31 @@ struct {
   uint8_t errors[MAX_SECTORS_PER_TRACK];
 } errorcache;
 
-static buffer_t *bam_buffer;  // recently-used buffer
-static buffer_t *bam_buffer2; // secondary buffer
+#ifdef CONFIG_D64_READAHEAD
+/* sectors following a file chain that runs through consecutive sectors */
+static struct {
+  uint8_t part;
+  uint8_t track;
+  uint8_t first;
+  uint8_t count;  /* 0 if empty */
+  uint8_t used;   /* entries before this one were handed out */
+  buffer_t *lent[CONFIG_D64_READAHEAD];  /* buffer that uses the entry */
+  uint8_t data[CONFIG_D64_READAHEAD][256];
+} readahead;
+#endif
+
+/* maximum number of BAM sectors kept in memory */
+#define BAM_BUFFERS 4
+
+/* BAM buffers beyond the second are only taken if this many stay free */
+#define BAM_SPARE_BUFFERS 4
+
+static buffer_t *bam_buffers[BAM_BUFFERS]; // most recently used first
 static uint8_t   bam_refcount;
 
+/* the buffer holding the BAM sector of the last move_bam_window call */
+#define bam_buffer (bam_buffers[0])
+
 /* ------------------------------------------------------------------------- */
 /*  Forward declarations                                                     */
 /* ------------------------------------------------------------------------- */
@@ -264,6 +290,54 @@ static uint16_t sectors_per_track(uint8_t part, uint8_t track) {
   }
 }
 
+#ifdef CONFIG_FAST_SERIAL
+/**
+ * d64_sectors_per_track - number of sectors on given track
+ * @part : partition number
+ * @track: Track number
+ *
+ * This function returns the number of sectors on the given track of
+ * the disk image in @part, it is used by the burst commands.
+ */
+uint16_t d64_sectors_per_track(uint8_t part, uint8_t track) {
+  return sectors_per_track(part, track);
+}
+#endif
+
+#ifdef CONFIG_TRACK_CACHE
+/**
+ * cached_read - read data from a sector through the track cache
+ * @part  : partition number
+ * @track : track number
+ * @sector: sector number
+ * @offset: offset of the data within the sector
+ * @buf   : target buffer
+ * @len   : number of bytes to read
+ *
+ * This function reads len bytes at offset within the specified sector.
+ * Tracks longer than the cache slots are split into windows of
+ * CONFIG_TRACK_CACHE_SECTORS sectors. Returns the same as image_read.
+ */
+static uint8_t cached_read(uint8_t part, uint8_t track, uint8_t sector,
+                           uint8_t offset, uint8_t *buf, uint16_t len) {
+  uint16_t spt   = sectors_per_track(part, track);
+  uint8_t  first = sector - sector % CONFIG_TRACK_CACHE_SECTORS;
+  uint16_t count = spt - first;
+
+  if (sector >= spt)
+    return image_read(part, sector_offset(part, track, sector) + offset, buf, len);
+
+  if (count > CONFIG_TRACK_CACHE_SECTORS)
+    count = CONFIG_TRACK_CACHE_SECTORS;
+
+  return trackcache_read(part, sector_offset(part, track, first), count,
+                         sector_offset(part, track, sector) + offset, buf, len);
+}
+#else
+#  define cached_read(part, track, sector, offset, buf, len) \
+  image_read(part, sector_offset(part, track, sector) + (offset), buf, len)
+#endif
+
 /**
  * checked_read - read a specified sector after range-checking
  * @part  : partition number
@@ -346,8 +420,107 @@ static uint8_t checked_read(uint8_t part, uint8_t track, uint8_t sector, uint8_t
     /* 1 is OK, unknown values are accepted too */
   }
 
-  return image_read(part, sector_offset(part,track,sector), buf, len);
+  return cached_read(part, track, sector, 0, buf, len);
+}
+
+#ifdef CONFIG_D64_READAHEAD
+/**
+ * d64_readahead_invalidate - drop read-ahead sectors of a partition
+ * @part: partition number, 0xff for all partitions
+ *
+ * This function must be called whenever the image file of a
+ * partition is written or changed.
+ */
+void d64_readahead_invalidate(uint8_t part) {
+  if (part == 0xff || readahead.part == part)
+    readahead.count = 0;
+}
+
+/**
+ * readahead_reclaim - take back the sectors lent to buffers
+ * @buf: buffer that is about to be refilled
+ *
+ * chain_read lends read-ahead sectors to the bus buffers by pointing
+ * their data at them. This function moves every buffer that still uses
+ * one back to its own data area, so the read-ahead can be refilled.
+ * The data is copied for all buffers except @buf. Buffers that were
+ * allocated again since then already use their own data area.
+ */
+static void readahead_reclaim(buffer_t *buf) {
+  for (uint8_t i = 0; i < CONFIG_D64_READAHEAD; i++) {
+    buffer_t *b = readahead.lent[i];
+
+    readahead.lent[i] = NULL;
+    if (b == NULL || b->data != readahead.data[i])
+      continue;
+
+    b->data = buffer_data_area(b);
+    if (b != buf)
+      memcpy(b->data, readahead.data[i], 256);
+  }
+}
+
+/**
+ * chain_read - read a sector of a file chain
+ * @part       : partition number
+ * @track      : track number to be read
+ * @sector     : sector number to be read
+ * @buf        : buffer that receives the sector
+ * @consecutive: true if the chain reached this sector from the one before it
+ *
+ * This function reads a full sector for d64_read. If the chain runs
+ * through consecutive sectors (e.g. interleave 1 on D81), up to
+ * CONFIG_D64_READAHEAD sectors of the track are read with a single
+ * access, so the next refills are served from memory. Sectors from
+ * the read-ahead cache are not copied, @buf uses the read-ahead
+ * memory until the next allocation or refill of the read-ahead.
+ * Returns the same as checked_read.
+ */
+static uint8_t chain_read(uint8_t part, uint8_t track, uint8_t sector,
+                          buffer_t *buf, bool consecutive) {
+  uint8_t count;
+
+  if (readahead.count != 0 && readahead.part == part &&
+      readahead.track == track && sector >= readahead.first &&
+      sector - readahead.first >= readahead.used &&
+      sector - readahead.first < readahead.count) {
+    sector -= readahead.first;
+    goto handoff;
+  }
+
+  /* sectors with error info are checked one at a time */
+  if (!consecutive || (partition[part].imagetype & D64_HAS_ERRORINFO) ||
+      track < 1 || track > get_param(part, LAST_TRACK) ||
+      sector >= sectors_per_track(part, track))
+    return checked_read(part, track, sector, buf->data, 256, ERROR_ILLEGAL_TS_LINK);
+
+  count = sectors_per_track(part, track) - sector;
+  if (count > CONFIG_D64_READAHEAD)
+    count = CONFIG_D64_READAHEAD;
+
+  readahead.count = 0;
+  readahead_reclaim(buf);
+  if (image_read(part, sector_offset(part, track, sector), readahead.data, 256 * count))
+    return checked_read(part, track, sector, buf->data, 256, ERROR_ILLEGAL_TS_LINK);
+
+  readahead.part  = part;
+  readahead.track = track;
+  readahead.first = sector;
+  readahead.count = count;
+  readahead.used  = 0;
+  sector = 0;
+
+ handoff:
+  /* the old contents of the buffer are not needed anymore */
+  buf->data = readahead.data[sector];
+  readahead.lent[sector] = buf;
+  readahead.used = sector + 1;
+  return 0;
 }
+#else
+#  define chain_read(part, track, sector, buf, consecutive) \
+  ((void)(consecutive), checked_read(part, track, sector, (buf)->data, 256, ERROR_ILLEGAL_TS_LINK))
+#endif
 
 /**
  * update_timestamp - update timestamp of a directory entry
@@ -361,7 +534,7 @@ static void update_timestamp(uint8_t *buffer) {
 #ifdef HAVE_RTC
   struct tm time;
 
-  read_rtc(&time);
+  read_rtc_cached(&time);
   buffer[DIR_OFS_YEAR]   = time.tm_year % 100;
   buffer[DIR_OFS_MONTH]  = time.tm_mon + 1;
   buffer[DIR_OFS_DAY]    = time.tm_mday;
@@ -405,8 +578,7 @@ static uint8_t write_entry(uint8_t part, struct d64dh *dh, uint8_t *buf, uint8_t
  * Returns the same as image_read (0 success, 1 partial read, 2 failed)
  */
 static uint8_t read_entry(uint8_t part, struct d64dh *dh, uint8_t *buf) {
-  return image_read(part, sector_offset(part, dh->track, dh->sector) +
-                          dh->entry * 32, buf, 32);
+  return cached_read(part, dh->track, dh->sector, dh->entry * 32, buf, 32);
 }
 
 /**
@@ -444,13 +616,14 @@ static uint8_t clear_dir_sector(uint8_t part, uint8_t t, uint8_t s, uint8_t *dat
 /* ------------------------------------------------------------------------- */
 
 /**
- * bam_buffer_flush - write BAM buffer to disk
- * @buf: pointer to the BAM buffer
+ * bam_buffer_write - write BAM buffer to disk
+ * @buf  : pointer to the BAM buffer
+ * @flush: sync the image file after writing if true
  *
- * This function writes the contents of the BAM buffer to the disk image.
- * Returns 0 if successful, != 0 otherwise.
+ * This function writes the contents of the BAM buffer to the disk image
+ * if it was changed. Returns 0 if successful, != 0 otherwise.
  */
-static uint8_t bam_buffer_flush(buffer_t *buf) {
+static uint8_t bam_buffer_write(buffer_t *buf, uint8_t flush) {
   uint8_t res;
 
   if (buf->mustflush && buf->pvt.bam.part < max_part) {
@@ -458,7 +631,7 @@ static uint8_t bam_buffer_flush(buffer_t *buf) {
                       sector_offset(buf->pvt.bam.part,
                                     buf->pvt.bam.track,
                                     buf->pvt.bam.sector),
-                      buf->data, 256, 1);
+                      buf->data, 256, flush);
     buf->mustflush = 0;
 
     return res;
@@ -466,22 +639,46 @@ static uint8_t bam_buffer_flush(buffer_t *buf) {
     return 0;
 }
 
+/**
+ * bam_buffer_flush - write BAM buffer to disk
+ * @buf: pointer to the BAM buffer
+ *
+ * This is the cleanup callback of the BAM buffers, it writes
+ * the buffer and syncs the image file.
+ * Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t bam_buffer_flush(buffer_t *buf) {
+  return bam_buffer_write(buf, 1);
+}
+
 /**
  * d64_bam_commit - write BAM buffers to disk
  *
  * This function is the exported interface to force the BAM buffer
- * contents to disk. Returns 0 if successful, != 0 otherwise.
+ * contents to disk. All changed BAM sectors are written, each image
+ * file is synced once after its last one.
+ * Returns 0 if successful, != 0 otherwise.
  */
 uint8_t d64_bam_commit(void) {
+  uint8_t i, j, flush;
   uint8_t res = 0;
 
-  if (bam_buffer)
-    res |= bam_buffer->cleanup(bam_buffer);
+  for (i = 0; i < BAM_BUFFERS; i++) {
+    buffer_t *buf = bam_buffers[i];
 
-  if (bam_buffer2)
-    res |= bam_buffer2->cleanup(bam_buffer2);
+    if (buf == NULL || !buf->mustflush)
+      continue;
 
-  return 0;
+    flush = 1;
+    for (j = i + 1; j < BAM_BUFFERS; j++)
+      if (bam_buffers[j] != NULL && bam_buffers[j]->mustflush &&
+          bam_buffers[j]->pvt.bam.part == buf->pvt.bam.part)
+        flush = 0;
+
+    res |= bam_buffer_write(buf, flush);
+  }
+
+  return res;
 }
 
 /**
@@ -506,14 +703,53 @@ static uint8_t bam_buffer_alloc(buffer_t **buf) {
 }
 
 /**
- * bam_buffer_swap - swap the two BAM buffers
+ * bam_buffer_touch - mark a BAM buffer as most recently used
+ * @index: index of the buffer in bam_buffers
  *
- * Thus function swaps the pointers to the two BAM buffers
+ * This function moves the buffer at @index to the front of bam_buffers,
+ * so it becomes bam_buffer.
  */
-static void bam_buffer_swap(void) {
-  buffer_t *tmp = bam_buffer;
-  bam_buffer    = bam_buffer2;
-  bam_buffer2   = tmp;
+static void bam_buffer_touch(uint8_t index) {
+  buffer_t *tmp = bam_buffers[index];
+
+  while (index > 0) {
+    bam_buffers[index] = bam_buffers[index - 1];
+    index--;
+  }
+  bam_buffers[0] = tmp;
+}
+
+/**
+ * bam_buffer_victim - select the buffer for a BAM sector that isn't cached
+ *
+ * This function returns the index of the buffer in bam_buffers that
+ * should receive a BAM sector that is not in memory yet. An unused
+ * buffer is preferred, a new buffer is allocated if enough buffers
+ * are free and the least recently used one is returned otherwise.
+ */
+static uint8_t bam_buffer_victim(void) {
+  uint8_t i, nfree = 0;
+
+  for (i = 0; i < BAM_BUFFERS && bam_buffers[i] != NULL; i++)
+    if (bam_buffers[i]->pvt.bam.part == 255)
+      return i;
+
+  if (i < BAM_BUFFERS) {
+    /* the first two BAM buffers are always taken if possible */
+    for (uint8_t j = 0; j < CONFIG_BUFFER_COUNT; j++)
+      if (!buffers[j].allocated)
+        nfree++;
+
+    if (i < 2 || nfree > BAM_SPARE_BUFFERS) {
+      if (!bam_buffer_alloc(&bam_buffers[i]))
+        return i;
+
+      /* allocation failed, reset error and continue with fewer buffers */
+      set_error(ERROR_OK);
+    }
+  }
+
+  return i - 1;
 }
 
 /**
@@ -549,12 +785,12 @@ static uint8_t bam_buffer_match(buffer_t *buf, uint8_t part,
  * calculates the correct pointer into the BAM sector for the appropriate
  * track.  Since the BAM contains both sector counts and sector allocation
  * bitmaps, type is used to signal which reference is desired.
- * This function may swap the BAM buffer pointers, after it returns
+ * This function may reorder the BAM buffers, after it returns
  * bam_buffer is always the buffer with the requested sector.
  * Returns 0 if successful, != 0 otherwise.
  */
 static uint8_t move_bam_window(uint8_t part, uint8_t track, bamdata_t type, uint8_t **ptr) {
-  uint8_t res;
+  uint8_t res, i;
   uint8_t t,s, pos;
 
   switch(partition[part].imagetype & D64_TYPE_MASK) {
@@ -607,47 +843,31 @@ static uint8_t move_bam_window(uint8_t part, uint8_t track, bamdata_t type, uint
     break;
   }
 
-  if (!bam_buffer_match(bam_buffer, part, t, s)) {
-    /* check if the second BAM buffer exists */
-    if (bam_buffer2) {
-      /* unconditionally swap to the other BAM buffer        */
-      /* either it has the data or it was less-recently used */
-
-      /* Note for future optimization:
-       * If buf1 is invalid and buf2 valid but not matching this will swap and
-       * use buf2 for the data instead of buf1 - using buf1
-       * while keeping buf2 without swapping would be better.
-       */
-      bam_buffer_swap();
-
-      /* check again, now in the other buffer */
-      if (bam_buffer_match(bam_buffer, part, t, s))
-        goto found;
-    } else {
-      /* allocate and swap to the second BAM buffer if the first one is valid */
-      if (bam_buffer->pvt.bam.part != 255) {
-        if (bam_buffer_alloc(&bam_buffer2)) {
-          /* allocation failed, reset error and continue with just one buffer */
-          set_error(ERROR_OK);
-        } else {
-          /* switch to the new buffer */
-          bam_buffer_swap();
-        }
-      }
+  /* look for the sector in all BAM buffers */
+  for (i = 0; i < BAM_BUFFERS && bam_buffers[i] != NULL; i++) {
+    if (bam_buffer_match(bam_buffers[i], part, t, s)) {
+      bam_buffer_touch(i);
+      goto found;
     }
+  }
 
-    /* Need to read the BAM sector - flush only the target buffer */
-    if (bam_buffer->cleanup(bam_buffer))
-      return 1;
+  if (bam_buffer == NULL && bam_buffer_alloc(&bam_buffer))
+    return 1;
 
-    res = image_read(part, sector_offset(part, t, s), bam_buffer->data, 256);
-    if(res)
-      return res;
+  /* Need to read the BAM sector - flush only the target buffer */
+  i = bam_buffer_victim();
+  bam_buffer_touch(i);
+  if (bam_buffer->cleanup(bam_buffer))
+    return 1;
 
-    bam_buffer->pvt.bam.part   = part;
-    bam_buffer->pvt.bam.track  = t;
-    bam_buffer->pvt.bam.sector = s;
-  }
+  bam_buffer->pvt.bam.part = 255;
+  res = cached_read(part, t, s, 0, bam_buffer->data, 256);
+  if(res)
+    return res;
+
+  bam_buffer->pvt.bam.part   = part;
+  bam_buffer->pvt.bam.track  = t;
+  bam_buffer->pvt.bam.sector = s;
 
  found:
   *ptr = bam_buffer->data + pos;
@@ -719,6 +939,49 @@ static uint16_t sectors_free(uint8_t part, uint8_t track) {
   }
 }
 
+/**
+ * counts_as_free - check if a sector is part of the free block count
+ * @part  : partition
+ * @track : track number
+ * @sector: sector number
+ *
+ * This function returns false for the sectors of the directory/BAM
+ * track (or the reserved system area of a DNP) that are not included
+ * in the "blocks free" count, true for all others.
+ */
+static bool counts_as_free(uint8_t part, uint8_t track, uint16_t sector) {
+  switch (partition[part].imagetype & D64_TYPE_MASK) {
+  case D64_TYPE_D81:
+    return track != D81_BAM_TRACK;
+
+  case D64_TYPE_DNP:
+    /* DNP reserves sectors 0-63 on track 1 */
+    return track != 1 || sector >= 64;
+
+  case D64_TYPE_D80:
+  case D64_TYPE_D82:
+    return track != D80_DIR_TRACK;
+
+  case D64_TYPE_D41:
+  case D64_TYPE_D71:
+  default:
+    return track != D41_BAM_TRACK && track != D71_BAM2_TRACK;
+  }
+}
+
+/**
+ * adjust_freeblocks - update the cached free block count
+ * @part  : partition
+ * @track : track number
+ * @sector: sector number that was allocated or freed
+ * @delta : change of the free block count (+1 or -1)
+ */
+static void adjust_freeblocks(uint8_t part, uint8_t track, uint8_t sector, int8_t delta) {
+  if (partition[part].freeblocks != FREEBLOCKS_UNKNOWN &&
+      counts_as_free(part, track, sector))
+    partition[part].freeblocks += delta;
+}
+
 /**
  * allocate_sector - mark a sector as used
  * @part  : partitoin
@@ -748,17 +1011,21 @@ static uint8_t allocate_sector(uint8_t part, uint8_t track, uint8_t sector) {
       trackmap[sector>>3] &= (uint8_t)~(0x80>>(sector&7));
 
       /* DNP has no counter in its BAM */
+      adjust_freeblocks(part, track, sector, -1);
       return 0;
     }
 
     trackmap[sector>>3] &= (uint8_t)~(1<<(sector&7));
 
-    if(move_bam_window(part,track,BAM_FREECOUNT,&trackmap))
+    if(move_bam_window(part,track,BAM_FREECOUNT,&trackmap)) {
+      partition[part].freeblocks = FREEBLOCKS_UNKNOWN;
       return 1;
+    }
 
     if (trackmap[0] > 0) {
       trackmap[0]--;
       bam_buffer->mustflush = 1;
+      adjust_freeblocks(part, track, sector, -1);
     }
   }
   return 0;
@@ -793,17 +1060,21 @@ static uint8_t free_sector(uint8_t part, uint8_t track, uint8_t sector) {
       trackmap[sector>>3] |= 0x80>>(sector&7);
 
       /* DNP has no counter in its BAM */
+      adjust_freeblocks(part, track, sector, 1);
       return 0;
     }
 
     trackmap[sector>>3] |= 1<<(sector&7);
 
-    if(move_bam_window(part,track,BAM_FREECOUNT,&trackmap))
+    if(move_bam_window(part,track,BAM_FREECOUNT,&trackmap)) {
+      partition[part].freeblocks = FREEBLOCKS_UNKNOWN;
       return 1;
+    }
 
     if(trackmap[0] < sectors_per_track(part, track)) {
       trackmap[0]++;
       bam_buffer->mustflush = 1;
+      adjust_freeblocks(part, track, sector, 1);
     }
   }
   return 0;
@@ -1131,11 +1402,15 @@ static uint8_t find_empty_entry(path_t *path, dh_t *dh) {
  * This is the callback used as refill for files opened for reading.
  */
 static uint8_t d64_read(buffer_t *buf) {
+  /* Check if the chain continues with the next sector on the track */
+  bool consecutive = (buf->data[0] == buf->pvt.d64.track &&
+                      buf->data[1] == buf->pvt.d64.sector + 1);
+
   /* Store the current sector, used for append */
   buf->pvt.d64.track  = buf->data[0];
   buf->pvt.d64.sector = buf->data[1];
 
-  if (checked_read(buf->pvt.d64.part, buf->data[0], buf->data[1], buf->data, 256, ERROR_ILLEGAL_TS_LINK)) {
+  if (chain_read(buf->pvt.d64.part, buf->data[0], buf->data[1], buf, consecutive)) {
     free_buffer(buf);
     return 1;
   }
@@ -1276,6 +1551,10 @@ uint8_t d64_mount(path_t *path, uint8_t *name) {
   uint8_t part = path->part;
   uint32_t fsize = partition[part].imagehandle.fsize;
 
+  trackcache_invalidate(part);
+  d64_readahead_invalidate(part);
+  partition[part].freeblocks = FREEBLOCKS_UNKNOWN;
+
   switch (fsize) {
   case 174848:
     imagetype = D64_TYPE_D41;
@@ -1439,10 +1718,8 @@ static uint8_t read_string_from_dirheader(path_t *path, uint8_t *buffer, param_t
   else
     sector = 0;
 
-  if (image_read(path->part,
-                 sector_offset(path->part, path->dir.dxx.track, sector)
-                 + get_param(path->part, what),
-                 buffer, size))
+  if (cached_read(path->part, path->dir.dxx.track, sector,
+                  get_param(path->part, what), buffer, size))
     return 1;
 
   strnsubst(buffer, size, 0xa0, 0x20);
@@ -1485,32 +1762,10 @@ static uint16_t d64_freeblocks(uint8_t part) {
   uint16_t blocks = 0;
   uint8_t i;
 
-  for (i = 1; i != 0 && i <= get_param(part, LAST_TRACK); i++) {
-    /* Skip directory track */
-    switch (partition[part].imagetype & D64_TYPE_MASK) {
-    case D64_TYPE_D81:
-      if (i == D81_BAM_TRACK)
-        continue;
-      break;
-
-    case D64_TYPE_DNP:
-      /* DNP reserves a partial track, handled below */
-      break;
-
-    case D64_TYPE_D41:
-    case D64_TYPE_D71:
-    default:
-      if (i == D41_BAM_TRACK || i == D71_BAM2_TRACK)
-        continue; // continue the for loop
-      break;      // break out of the switch
-
-    case D64_TYPE_D80:
-    case D64_TYPE_D82:
-      if (i == D80_DIR_TRACK)
-        continue; // continue the for loop
-      break;      // break out of the switch
-    }
+  if (partition[part].freeblocks != FREEBLOCKS_UNKNOWN)
+    return partition[part].freeblocks;
 
+  for (i = 1; i != 0 && i <= get_param(part, LAST_TRACK); i++) {
     if ((partition[part].imagetype & D64_TYPE_MASK)
         == D64_TYPE_DNP && i == 1) {
       /* DNP: ignore sectors 0-63 on track 1 */
@@ -1519,11 +1774,16 @@ static uint16_t d64_freeblocks(uint8_t part) {
           blocks++;
       }
 
-    } else {
+    } else if (counts_as_free(part, i, 0)) {
+      /* Skip directory track */
       blocks += sectors_free(part,i);
     }
   }
 
+  /* A read error would leave the count too low, don't keep it */
+  if (current_error == ERROR_OK)
+    partition[part].freeblocks = blocks;
+
   return blocks;
 }
 
@@ -1667,8 +1927,11 @@ static void d64_write_sector(buffer_t *buf, uint8_t part, uint8_t track, uint8_t
   if (track < 1 || track > get_param(part, LAST_TRACK) ||
       sector >= sectors_per_track(part, track)) {
     set_error_ts(ERROR_ILLEGAL_TS_COMMAND,track,sector);
-  } else
+  } else {
+    /* The sector may hold a part of the BAM */
+    partition[part].freeblocks = FREEBLOCKS_UNKNOWN;
     image_write(part, sector_offset(part,track,sector), buf->data, 256, 1);
+  }
 }
 
 static void d64_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
@@ -1887,10 +2150,12 @@ static void d64_mkdir(path_t *path, uint8_t *dirname) {
  * a card change is detected.
  */
 void d64_invalidate(void) {
-  free_buffer(bam_buffer);
-  bam_buffer   = NULL;
-  free_buffer(bam_buffer2);
-  bam_buffer2  = NULL;
+  /* the BAM buffers are dropped, there is nothing left to commit */
+  bgtask_cancel(BGTASK_BAM_COMMIT);
+  for (uint8_t i = 0; i < BAM_BUFFERS; i++) {
+    free_buffer(bam_buffers[i]);
+    bam_buffers[i] = NULL;
+  }
   bam_refcount = 0;
 }
 
@@ -1902,25 +2167,21 @@ void d64_invalidate(void) {
  * refcounting for the BAM buffers.
  */
 void d64_unmount(uint8_t part) {
-  /* invalidate BAM buffers that point to the current partition */
-  if (bam_buffer) {
-    bam_buffer->cleanup(bam_buffer);
-    if (bam_buffer->pvt.bam.part == part)
-      bam_buffer->pvt.bam.part = 255;
-  }
+  uint8_t i;
 
-  if (bam_buffer2) {
-    bam_buffer2->cleanup(bam_buffer2);
-    if (bam_buffer2->pvt.bam.part == part)
-      bam_buffer2->pvt.bam.part = 255;
-  }
+  /* invalidate BAM buffers that point to the current partition */
+  d64_bam_commit();
+  bgtask_cancel(BGTASK_BAM_COMMIT);
+  for (i = 0; i < BAM_BUFFERS; i++)
+    if (bam_buffers[i] != NULL && bam_buffers[i]->pvt.bam.part == part)
+      bam_buffers[i]->pvt.bam.part = 255;
 
   /* decrease BAM buffer refcounter - it can never be zero while a Dxx is mounted*/
-  if (--bam_refcount) {
-    free_buffer(bam_buffer);
-    free_buffer(bam_buffer2);
-    bam_buffer  = NULL;
-    bam_buffer2 = NULL;
+  if (--bam_refcount == 0) {
+    for (i = 0; i < BAM_BUFFERS; i++) {
+      free_buffer(bam_buffers[i]);
+      bam_buffers[i] = NULL;
+    }
   }
 }
 
@@ -2090,9 +2351,10 @@ static void d64_format(uint8_t part, uint8_t *name, uint8_t *id) {
 
   /* Flush BAM buffers and mark their contents as invalid */
   d64_bam_commit();
-  bam_buffer->pvt.bam.part = 0xff;
-  if (bam_buffer2)
-    bam_buffer2->pvt.bam.part = 0xff;
+  partition[part].freeblocks = FREEBLOCKS_UNKNOWN;
+  for (uint8_t i = 0; i < BAM_BUFFERS; i++)
+    if (bam_buffers[i] != NULL)
+      bam_buffers[i]->pvt.bam.part = 0xff;
 
   if (id != NULL) {
     /* Clear the data area of the disk image */
@@ -65,4 +65,14 @@ uint8_t d64_bam_commit(void);
 void d64_raw_directory(path_t *path, buffer_t *buf);
 void d64_invalidate(void);
 
+#ifdef CONFIG_FAST_SERIAL
+uint16_t d64_sectors_per_track(uint8_t part, uint8_t track);
+#endif
+
+#ifdef CONFIG_D64_READAHEAD
+void d64_readahead_invalidate(uint8_t part);
+#else
+#  define d64_readahead_invalidate(part) do {} while (0)
+#endif
+
 #endif
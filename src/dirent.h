@@ -199,6 +199,7 @@ typedef struct d64fh {
  * @part: partition number for the handle
  * @fat : fat directory handle
  * @d64 : d64 directory handle
+ * @index: next entry in the FAT directory index (if enabled)
  *
  * This is a union of directory handles for all supported file types
  * which is used as an opaque type to be passed between openddir and
@@ -211,6 +212,9 @@ typedef struct dh_s {
     struct d64dh d64;
     eefs_dir_t   eefs;
   } dir;
+#ifdef CONFIG_FAT_DIRINDEX
+  uint16_t index;
+#endif
 } dh_t;
 
 /* This enum must match the struct param_s below! */
@@ -253,6 +257,8 @@ struct param_s {
  * @imagehandle: file handle of a mounted image file on this partition
  * @imagetype  : disk image type mounted on this partition
  * @d64data    : extended information about a mounted Dxx image
+ * @freeblocks : cached free block count of a mounted Dxx image
+ * @imagewritten: the mounted image was modified (if the index is enabled)
  *
  * This data structure holds per-partition data.
  */
@@ -263,6 +269,10 @@ typedef struct partition_s {
   FIL                    imagehandle;
   uint8_t                imagetype;
   struct param_s         d64data;
+  uint16_t               freeblocks;
+#ifdef CONFIG_FAT_DIRINDEX
+  uint8_t                imagewritten;
+#endif
 } partition_t;
 
 #endif
@@ -0,0 +1,614 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   dirindex.c: Persistent FAT directory index
+
+   Large subdirectories get a hidden index file that holds the converted
+   directory entries in directory order, followed by a table of entry
+   numbers in the sort order of the file browser. Directory reads are
+   served from the index instead of converting every FAT entry again.
+
+   The index is only used for directory listings, file lookups read the
+   FAT directory directly. The index stores a hash of the FAT directory
+   entries including their long names, which is checked at the start of every listing,
+   so changes made on a PC or another host are detected. Changes made
+   through fatops delete the index file of the directory, it is rebuilt
+   on the next directory listing.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "buffers.h"
+#include "dirent.h"
+#include "errormsg.h"
+#include "fatops.h"
+#include "ff.h"
+#include "flags.h"
+#include "parser.h"
+#include "progmem.h"
+#include "ustring.h"
+#include "wrapops.h"
+#include "dirindex.h"
+
+#define INDEX_MAGIC        0x31494e44UL  /* "DNI1" */
+#define INDEX_MIN_ENTRIES  64
+#define SORT_BUFFERS       8
+#define SORT_OUTBUF        32
+#define NO_PART            0xff
+
+#define IDXFLAG_EXTHIDE    1
+#define IDXFLAG_SORTED     2
+
+static const PROGMEM char index_name[] = "DIRINDEX.NDX";
+static const PROGMEM char temp_name[]  = "DIRINDEX.TMP";
+
+typedef struct {
+  uint32_t magic;
+  uint32_t stamp;     /* hash of the directory entries */
+  uint16_t recsize;   /* sizeof(cbmdirent_t), differs between builds */
+  uint16_t count;     /* number of entries in directory order */
+  uint16_t sorted;    /* number of entries in the sorted table */
+  uint8_t  flags;
+  uint8_t  pad;
+} idxheader_t;
+
+typedef struct {
+  uint8_t  class;     /* directories first, then images, then files */
+  uint8_t  name[CBM_NAME_LENGTH];
+  uint16_t index;     /* entry number in directory order */
+} sortkey_t;
+
+typedef struct {
+  sortkey_t key;      /* current head of the run */
+  uint16_t  pos;      /* position of key in the temporary file */
+  uint16_t  end;      /* end of the run in the temporary file */
+} sortrun_t;
+
+static FIL      index_fh;
+static uint8_t  index_part = NO_PART;
+static uint32_t index_dir;
+static uint32_t index_stamp;
+static uint16_t index_count;
+static uint16_t index_sorted;
+static uint8_t  index_flags;
+
+/* Last directory that could not be indexed */
+static uint8_t  skip_part = NO_PART;
+static uint32_t skip_dir;
+static uint32_t skip_stamp;
+
+static uint8_t exthide_flag(void) {
+  return (globalflags & EXTENSION_HIDING) ? IDXFLAG_EXTHIDE : 0;
+}
+
+static FRESULT open_named(uint8_t part, uint32_t dir, FIL *fh,
+                          const char *name, uint8_t mode) {
+  ustrcpy_P(ops_scratch, name);
+  partition[part].fatfs.curr_dir = dir;
+  return f_open(&partition[part].fatfs, fh, ops_scratch, mode);
+}
+
+static void unlink_named(uint8_t part, uint32_t dir, const char *name) {
+  ustrcpy_P(ops_scratch, name);
+  partition[part].fatfs.curr_dir = dir;
+  f_unlink(&partition[part].fatfs, ops_scratch);
+}
+
+static void close_index(void) {
+  if (index_part != NO_PART) {
+    f_close(&index_fh);
+    index_part = NO_PART;
+  }
+}
+
+static FRESULT read_at(FIL *fh, uint32_t offset, void *data, UINT size) {
+  FRESULT res;
+  UINT bytesread;
+
+  res = f_lseek(fh, offset);
+  if (res == FR_OK)
+    res = f_read(fh, data, size, &bytesread);
+  if (res == FR_OK && bytesread != size)
+    res = FR_RW_ERROR;
+  return res;
+}
+
+static FRESULT read_record(uint16_t num, cbmdirent_t *dent) {
+  return read_at(&index_fh, sizeof(idxheader_t) + (uint32_t)num * sizeof(cbmdirent_t),
+                 dent, sizeof(cbmdirent_t));
+}
+
+/**
+ * dir_stamp - calculate the validity stamp of a directory
+ * @part: partition
+ * @dir : start cluster of the directory
+ *
+ * This function hashes the entries of a directory: long and short
+ * names, sizes, start clusters, time stamps and attributes. Directory
+ * time stamps are not updated by all systems when files are added, so
+ * the entries themselves are checked. The long name is included
+ * because a rename on a PC may keep the short name and the time.
+ * The entries are read with the same long name buffer as fat_readdir,
+ * so every name change that is visible in a listing is detected. This is much faster than converting
+ * them, which may require reading the header of every x00 file.
+ * Returns 0 if the directory has less than INDEX_MIN_ENTRIES entries
+ * or could not be read.
+ */
+static uint32_t dir_stamp(uint8_t part, uint32_t dir) {
+  DIR dh;
+  FILINFO finfo;
+  uint32_t stamp = 0;
+  uint16_t count = 0;
+  uint8_t i;
+
+  finfo.lfn = ops_scratch;
+
+  if (l_opendir(&partition[part].fatfs, dir, &dh) != FR_OK)
+    return 0;
+
+  while (1) {
+    if (f_readdir(&dh, &finfo) != FR_OK)
+      return 0;
+
+    if (!finfo.fname[0])
+      break;
+
+    if (dirindex_is_own(finfo.fname))
+      continue;
+
+    for (i = 0; finfo.fname[i]; i++)
+      stamp = ((stamp << 5) | (stamp >> 27)) ^ finfo.fname[i];
+    for (i = 0; finfo.lfn[i]; i++)
+      stamp = ((stamp << 5) | (stamp >> 27)) ^ finfo.lfn[i];
+    stamp = ((stamp << 7) | (stamp >> 25)) ^ finfo.fsize ^ finfo.clust ^
+            ((uint32_t)finfo.fdate << 16) ^ finfo.ftime ^ finfo.fattrib;
+    count++;
+  }
+
+  if (count < INDEX_MIN_ENTRIES)
+    return 0;
+
+  stamp ^= count;
+  return stamp ? stamp : 1;
+}
+
+/* Open the index file of a directory if it is up to date */
+static bool open_index(uint8_t part, uint32_t dir, uint32_t stamp) {
+  idxheader_t hdr;
+
+  if (open_named(part, dir, &index_fh, index_name, FA_OPEN_EXISTING | FA_READ) != FR_OK)
+    return false;
+
+  if (read_at(&index_fh, 0, &hdr, sizeof(hdr)) != FR_OK ||
+      hdr.magic   != INDEX_MAGIC ||
+      hdr.stamp   != stamp ||
+      hdr.recsize != sizeof(cbmdirent_t) ||
+      (hdr.flags & IDXFLAG_EXTHIDE) != exthide_flag()) {
+    f_close(&index_fh);
+    return false;
+  }
+
+  index_part   = part;
+  index_dir    = dir;
+  index_stamp  = stamp;
+  index_count  = hdr.count;
+  index_sorted = (hdr.flags & IDXFLAG_SORTED) ? hdr.sorted : 0;
+  index_flags  = hdr.flags;
+  return true;
+}
+
+static int compare_keys(const void *p1, const void *p2) {
+  const sortkey_t *a = p1;
+  const sortkey_t *b = p2;
+  int res;
+
+  if (a->class != b->class)
+    return (a->class < b->class) ? -1 : 1;
+
+  res = memcmp(a->name, b->name, CBM_NAME_LENGTH);
+  if (res)
+    return res;
+
+  return (a->index < b->index) ? -1 : (a->index > b->index);
+}
+
+static FRESULT read_key(FIL *fh, uint16_t pos, sortkey_t *key) {
+  return read_at(fh, (uint32_t)pos * sizeof(sortkey_t), key, sizeof(sortkey_t));
+}
+
+/**
+ * sort_index - append the sorted entry table to the index file
+ * @part : partition
+ * @dir  : start cluster of the directory
+ * @count: number of entries in the index file
+ *
+ * This function sorts the visible entries of the index file that is
+ * currently being written, using an external merge sort: sorted runs
+ * that fit into a few buffers are written to a temporary file and
+ * merged in a single pass. Returns the number of sorted entries or
+ * DIRINDEX_NONE if there was not enough memory.
+ */
+static uint16_t sort_index(uint8_t part, uint32_t dir, uint16_t count) {
+  buffer_t *buf, *p;
+  FIL tmp_fh;
+  cbmdirent_t dent;
+  sortkey_t *keys;
+  sortrun_t *runs;
+  uint16_t *out;
+  uint16_t pool, runlen, numruns, i, n, visible, written;
+  uint16_t result = DIRINDEX_NONE;
+  uint8_t nbuf, olderror;
+  UINT bytes;
+  FRESULT res;
+
+  /* Grab as many continuous buffers as possible */
+  olderror = current_error;
+  buf = NULL;
+  for (nbuf = SORT_BUFFERS; nbuf > 1 && buf == NULL; nbuf--)
+    buf = alloc_linked_buffers(nbuf);
+  if (current_error != olderror)
+    set_error(olderror);
+  if (buf == NULL)
+    return DIRINDEX_NONE;
+  nbuf++;
+
+  pool    = nbuf * 256;
+  runlen  = pool / sizeof(sortkey_t);
+  numruns = (count + runlen - 1) / runlen;
+  if (numruns * sizeof(sortrun_t) + SORT_OUTBUF * sizeof(uint16_t) > pool)
+    goto fail;
+
+  if (open_named(part, dir, &tmp_fh, temp_name,
+                 FA_CREATE_ALWAYS | FA_WRITE | FA_READ) != FR_OK)
+    goto fail;
+
+  /* Phase 1: write sorted runs of the visible entries */
+  keys    = (sortkey_t *)buf->data;
+  visible = 0;
+  i       = 0;
+  while (i < count) {
+    n = 0;
+    while (i < count && n < runlen) {
+      if (read_record(i, &dent) != FR_OK)
+        goto fail_tmp;
+
+      if (!(dent.typeflags & FLAG_HIDDEN)) {
+        if ((dent.typeflags & EXT_TYPE_MASK) == TYPE_DIR)
+          keys[n].class = 0;
+        else if (dent.opstype == OPSTYPE_FAT &&
+                 check_imageext(dent.pvt.fat.realname) != IMG_UNKNOWN)
+          keys[n].class = 1;
+        else
+          keys[n].class = 2;
+        memcpy(keys[n].name, dent.name, CBM_NAME_LENGTH);
+        keys[n].index = i;
+        n++;
+      }
+      i++;
+    }
+
+    qsort(keys, n, sizeof(sortkey_t), compare_keys);
+    res = f_write(&tmp_fh, keys, n * sizeof(sortkey_t), &bytes);
+    if (res != FR_OK || bytes != n * sizeof(sortkey_t))
+      goto fail_tmp;
+    visible += n;
+  }
+
+  /* Phase 2: merge all runs into the index file */
+  runs    = (sortrun_t *)buf->data;
+  out     = (uint16_t *)(buf->data + pool - SORT_OUTBUF * sizeof(uint16_t));
+  numruns = (visible + runlen - 1) / runlen;
+
+  for (i = 0; i < numruns; i++) {
+    runs[i].pos = i * runlen;
+    runs[i].end = (visible - runs[i].pos > runlen) ? runs[i].pos + runlen : visible;
+    if (read_key(&tmp_fh, runs[i].pos, &runs[i].key) != FR_OK)
+      goto fail_tmp;
+  }
+
+  n       = 0;
+  written = 0;
+  while (written + n < visible) {
+    sortrun_t *min = NULL;
+
+    for (i = 0; i < numruns; i++)
+      if (runs[i].pos < runs[i].end &&
+          (min == NULL || compare_keys(&runs[i].key, &min->key) < 0))
+        min = &runs[i];
+
+    out[n++] = min->key.index;
+    if (++min->pos < min->end &&
+        read_key(&tmp_fh, min->pos, &min->key) != FR_OK)
+      goto fail_tmp;
+
+    if (n == SORT_OUTBUF || written + n == visible) {
+      res = f_lseek(&index_fh, sizeof(idxheader_t) +
+                    (uint32_t)count * sizeof(cbmdirent_t) +
+                    written * sizeof(uint16_t));
+      if (res == FR_OK)
+        res = f_write(&index_fh, out, n * sizeof(uint16_t), &bytes);
+      if (res != FR_OK || bytes != n * sizeof(uint16_t))
+        goto fail_tmp;
+      written += n;
+      n = 0;
+    }
+  }
+
+  result = visible;
+
+ fail_tmp:
+  f_close(&tmp_fh);
+  unlink_named(part, dir, temp_name);
+
+ fail:
+  p = buf;
+  do {
+    free_buffer(p);
+    p = p->pvt.buffer.next;
+  } while (p != NULL);
+
+  return result;
+}
+
+/**
+ * build_index - create the index file for a directory
+ * @part : partition
+ * @dir  : start cluster of the directory
+ * @stamp: current validity stamp of the directory
+ *
+ * This function converts all entries of the directory and stores them
+ * in a new index file together with the sorted entry table. The index
+ * is left open for reading if successful.
+ */
+static void build_index(uint8_t part, uint32_t dir, uint32_t stamp) {
+  idxheader_t hdr;
+  cbmdirent_t dent;
+  dh_t dh;
+  UINT bytes;
+  uint16_t sorted;
+  uint8_t i;
+  int8_t res;
+
+  /* Sizes of files that are still being written would be stale */
+  for (i = 0; i < CONFIG_BUFFER_COUNT; i++)
+    if (buffers[i].allocated && buffers[i].write)
+      return;
+
+  if (open_named(part, dir, &index_fh, index_name,
+                 FA_CREATE_ALWAYS | FA_WRITE | FA_READ) != FR_OK)
+    return;
+
+  /* The magic is written last, an interrupted build is never valid */
+  memset(&hdr, 0, sizeof(hdr));
+  if (f_write(&index_fh, &hdr, sizeof(hdr), &bytes) != FR_OK)
+    goto fail;
+
+  dh.part  = part;
+  dh.index = DIRINDEX_NONE;
+  if (l_opendir(&partition[part].fatfs, dir, &dh.dir.fat) != FR_OK)
+    goto fail;
+
+  while ((res = fat_readdir(&dh, &dent)) == 0) {
+    if (f_write(&index_fh, &dent, sizeof(dent), &bytes) != FR_OK ||
+        bytes != sizeof(dent) ||
+        ++hdr.count == DIRINDEX_NONE)
+      goto fail;
+  }
+  if (res > 0)
+    goto fail;
+
+  sorted = sort_index(part, dir, hdr.count);
+
+  hdr.magic   = INDEX_MAGIC;
+  hdr.stamp   = stamp;
+  hdr.recsize = sizeof(cbmdirent_t);
+  hdr.flags   = exthide_flag();
+  if (sorted != DIRINDEX_NONE) {
+    hdr.sorted = sorted;
+    hdr.flags |= IDXFLAG_SORTED;
+  }
+
+  if (f_lseek(&index_fh, 0) != FR_OK ||
+      f_write(&index_fh, &hdr, sizeof(hdr), &bytes) != FR_OK)
+    goto fail;
+
+  if (f_close(&index_fh) != FR_OK)
+    goto fail_closed;
+
+  ustrcpy_P(ops_scratch, index_name);
+  f_chmod(&partition[part].fatfs, ops_scratch, AM_HID, AM_HID);
+
+  open_index(part, dir, stamp);
+  return;
+
+ fail:
+  f_close(&index_fh);
+ fail_closed:
+  unlink_named(part, dir, index_name);
+}
+
+/**
+ * select_index - make the index of a directory the current one
+ * @part : partition
+ * @dir  : start cluster of the directory
+ * @check: true at the start of a listing
+ *
+ * This function opens the index file of a directory. If @check is
+ * true, the index is verified against the current directory contents
+ * and built if it is missing or outdated. Otherwise only an index that
+ * is already open is used, which is checked once per listing only.
+ * Returns true if the index is available.
+ */
+static bool select_index(uint8_t part, uint32_t dir, bool check) {
+  uint32_t stamp;
+
+  if (!check)
+    return index_part == part && index_dir == dir &&
+           (index_flags & IDXFLAG_EXTHIDE) == exthide_flag();
+
+  /* Small directories are read directly */
+  stamp = dir_stamp(part, dir);
+  if (stamp == 0) {
+    close_index();
+    return false;
+  }
+
+  if (index_part == part && index_dir == dir && index_stamp == stamp &&
+      (index_flags & IDXFLAG_EXTHIDE) == exthide_flag())
+    return true;
+
+  if (skip_part == part && skip_dir == dir && skip_stamp == stamp)
+    return false;
+
+  close_index();
+
+  if (open_index(part, dir, stamp))
+    return true;
+
+  build_index(part, dir, stamp);
+  if (index_part == part && index_dir == dir)
+    return true;
+
+  skip_part  = part;
+  skip_dir   = dir;
+  skip_stamp = stamp;
+  return false;
+}
+
+/**
+ * dirindex_reset - forget all index state
+ *
+ * This function must be called when the file system was (re)mounted.
+ */
+void dirindex_reset(void) {
+  index_part = NO_PART;
+  skip_part  = NO_PART;
+}
+
+/**
+ * dirindex_invalidate - remove the index of a directory
+ * @path: path of the directory
+ *
+ * This function must be called before fatops changes a directory.
+ */
+void dirindex_invalidate(path_t *path) {
+  if (skip_part == path->part && skip_dir == path->dir.fat) {
+    /* Nothing to delete, but the directory may grow large enough */
+    skip_part = NO_PART;
+    return;
+  }
+
+  if (index_part == path->part && index_dir == path->dir.fat)
+    close_index();
+
+  unlink_named(path->part, path->dir.fat, index_name);
+}
+
+/**
+ * dirindex_opendir - use the index for a directory listing if possible
+ * @dh  : directory handle, already opened for the directory
+ * @path: path of the directory
+ *
+ * This function must only be called for directory handles that are
+ * used to generate a listing, lookups are faster without the index.
+ */
+void dirindex_opendir(dh_t *dh, path_t *path) {
+  if (partition[path->part].fop != &fatops)
+    return;
+
+  if (select_index(path->part, path->dir.fat, true))
+    dh->index = 0;
+}
+
+/**
+ * dirindex_readdir - read the next entry from the index
+ * @dh  : directory handle
+ * @dent: CBM directory entry for returning data
+ *
+ * Returns 1 if the index can not be used anymore, -1 if there are no
+ * more directory entries and 0 if successful. The caller should
+ * continue the listing with the FAT directory if 1 is returned.
+ */
+int8_t dirindex_readdir(dh_t *dh, cbmdirent_t *dent) {
+  if (!select_index(dh->part, dh->dir.fat.sclust, false))
+    return 1;
+
+  if (dh->index >= index_count)
+    return -1;
+
+  if (read_record(dh->index, dent) != FR_OK) {
+    close_index();
+    return 1;
+  }
+
+  dh->index++;
+  return 0;
+}
+
+/* Check if name is one of the files used for the index */
+bool dirindex_is_own(uint8_t *name) {
+  return !ustrcmp_P(name, index_name) || !ustrcmp_P(name, temp_name);
+}
+
+/**
+ * dirindex_sorted - prepare sorted access to a directory
+ * @path: path of the directory
+ *
+ * This function returns the number of visible entries in the sorted
+ * table of the index for path, building it if required. Returns
+ * DIRINDEX_NONE if there is no sorted index for this directory.
+ */
+uint16_t dirindex_sorted(path_t *path) {
+  if (partition[path->part].fop != &fatops ||
+      !select_index(path->part, path->dir.fat, true) ||
+      !(index_flags & IDXFLAG_SORTED))
+    return DIRINDEX_NONE;
+
+  return index_sorted;
+}
+
+/**
+ * dirindex_read_sorted - read an entry in sorted order
+ * @path: path of the directory
+ * @pos : position in the sorted table
+ * @dent: CBM directory entry for returning data
+ *
+ * Returns 0 if successful, != 0 otherwise.
+ */
+int8_t dirindex_read_sorted(path_t *path, uint16_t pos, cbmdirent_t *dent) {
+  uint16_t num;
+
+  if (!select_index(path->part, path->dir.fat, false) ||
+      !(index_flags & IDXFLAG_SORTED) || pos >= index_sorted)
+    return 1;
+
+  if (read_at(&index_fh, sizeof(idxheader_t) +
+              (uint32_t)index_count * sizeof(cbmdirent_t) +
+              pos * sizeof(uint16_t), &num, sizeof(num)) != FR_OK ||
+      num >= index_count)
+    return 1;
+
+  return read_record(num, dent) != FR_OK;
+}
@@ -0,0 +1,63 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   dirindex.h: Definitions for the persistent FAT directory index
+
+*/
+
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "dirent.h"
+
+/* dh_t.index value for directories read directly from FAT */
+#define DIRINDEX_NONE 0xffff
+
+#ifdef CONFIG_FAT_DIRINDEX
+
+void     dirindex_reset(void);
+void     dirindex_invalidate(path_t *path);
+void     dirindex_opendir(dh_t *dh, path_t *path);
+int8_t   dirindex_readdir(dh_t *dh, cbmdirent_t *dent);
+bool     dirindex_is_own(uint8_t *name);
+uint16_t dirindex_sorted(path_t *path);
+int8_t   dirindex_read_sorted(path_t *path, uint16_t pos, cbmdirent_t *dent);
+
+#  define dirindex_active(dh) ((dh)->index != DIRINDEX_NONE)
+
+#else
+
+#  define dirindex_reset()               do {} while (0)
+#  define dirindex_invalidate(p)         do {} while (0)
+#  define dirindex_opendir(dh,p)         do {} while (0)
+#  define dirindex_readdir(dh,d)         (-1)
+#  define dirindex_is_own(n)             false
+#  define dirindex_sorted(p)             DIRINDEX_NONE
+#  define dirindex_read_sorted(p,pos,d)  1
+#  define dirindex_active(dh)            false
+
+#endif
+
+#endif
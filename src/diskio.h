@@ -69,6 +69,20 @@ typedef struct {
   uint32_t sectorcount;  /* 2 TB should be enough... (512 byte sectors) */
 } diskinfo0_t;
 
+/**
+ * struct diskinfo1_t - disk info data structure for page 1
+ * @validbytes: Number of valid bytes in this struct
+ * @id        : identification of the medium (CID register for SD cards)
+ *
+ * This is the struct returned in the data buffer when disk_getinfo
+ * is called with page=1. Media without an identification return
+ * an error for this page.
+ */
+typedef struct {
+  uint8_t  validbytes;
+  uint8_t  id[16];
+} diskinfo1_t;
+
 /*---------------------------------------*/
 /* Prototypes for disk control functions */
 
@@ -41,6 +41,9 @@
 #include "fastloader-ll.h"
 #include "fatops.h"
 #include "ff.h"
+#ifdef CONFIG_FAST_SERIAL
+#  include "iec.h"
+#endif
 #include "fileops.h"
 #include "filesystem.h"
 #include "flags.h"
@@ -199,6 +202,22 @@ static const PROGMEM struct fastloader_crc_s fl_crc_table[] = {
 
   { 0, FL_NONE, 0 }, // end marker
 };
+
+/* Loader families whose uploads vary after a common prefix: matched */
+/* when the CRC reaches a value just as a specific byte is uploaded. */
+struct fastloader_prefix_s {
+  uint16_t crc;
+  uint8_t  byte;
+  uint8_t  loadertype;
+};
+
+static const PROGMEM struct fastloader_prefix_s fl_prefix_table[] = {
+#ifdef CONFIG_LOADER_GIJOE
+  { 0x38a2, 0x60, FL_GI_JOE }, // identical code, but lots of upload variations
+#endif
+
+  { 0, 0, FL_NONE }, // end marker
+};
 #endif // CONFIG_HAVE_IEC
 
 struct fastloader_handler_s {
@@ -329,6 +348,15 @@ date_t date_match_end;
 uint16_t datacrc = 0xffff;
 static fastloaderid_t previous_loader;
 
+#ifdef CONFIG_HAVE_IEC
+/* Additional M-W CRCs started at the second and following chunks of */
+/* an upload, so a loader is still found after unrelated M-W commands */
+#define FL_CRC_STARTS 3
+
+static uint16_t chunkcrc[FL_CRC_STARTS];
+static uint8_t  chunkcrc_count;
+#endif
+
 #ifdef CONFIG_HAVE_IEC
 /* partial fastloader data capture */
 static uint16_t  capture_address, capture_remain;
@@ -857,13 +885,23 @@ static void parse_copy(void) {
 
     /* Open the destination file (first source only) */
     if (savedtype == 0) {
+#ifdef CONFIG_FAT_PREALLOC
+      uint16_t blocks = dent.blocksize;
+#endif
+
       savedtype = dent.typeflags & TYPE_MASK;
       memset(&dent, 0, sizeof(dent));
       ustrncpy(dent.name, dstname, CBM_NAME_LENGTH);
       if (savedtype == TYPE_REL)
         open_rel(&dstpath, &dent, dstbuf, srcbuf->recordlen, 1);
-      else
+      else {
         open_write(&dstpath, &dent, savedtype, dstbuf, 0);
+#ifdef CONFIG_FAT_PREALLOC
+        /* The size of the first source is a good estimate */
+        if (current_error == 0)
+          fat_preallocate(dstbuf, (uint32_t)blocks * 254);
+#endif
+      }
     }
 
     while (1) {
@@ -1266,9 +1304,40 @@ static void capture_fl_data(uint16_t address, uint8_t length) {
 }
 
 
+/* Find the fastloader_crc_s entry for crc, returns NULL if none */
+static const struct fastloader_crc_s *find_crc(uint16_t crc) {
+  const struct fastloader_crc_s *crcptr = fl_crc_table;
+
+  while (pgm_read_byte(&crcptr->loadertype) != FL_NONE) {
+    if (crc == pgm_read_word(&crcptr->crc))
+      return crcptr;
+
+    crcptr++;
+  }
+
+  return NULL;
+}
+
+/* Find a loader family whose prefix ends with byte at CRC crc */
+static uint8_t find_prefix(uint16_t crc, uint8_t byte) {
+  const struct fastloader_prefix_s *ptr = fl_prefix_table;
+  uint8_t loader;
+
+  while ( (loader = pgm_read_byte(&ptr->loadertype)) != FL_NONE ) {
+    if (crc == pgm_read_word(&ptr->crc) &&
+        byte == pgm_read_byte(&ptr->byte))
+      break;
+
+    ptr++;
+  }
+
+  return loader;
+}
+
 static void handle_memwrite(void) {
+  const struct fastloader_crc_s *crcptr;
   uint16_t address;
-  uint8_t  i, length;
+  uint8_t  i, j, length, loader;
 
   if (command_length < 6)
     return;
@@ -1292,27 +1361,36 @@ static void handle_memwrite(void) {
 
   previous_loader = FL_NONE;
 
-  for (i=0;i<command_buffer[5];i++) {
-    datacrc = crc16_update(datacrc, command_buffer[i+6]);
+  /* start another CRC at this chunk unless a new upload begins here */
+  if (datacrc == 0xffff)
+    chunkcrc_count = 0;
+  else if (chunkcrc_count < FL_CRC_STARTS)
+    chunkcrc[chunkcrc_count++] = 0xffff;
 
-#ifdef CONFIG_LOADER_GIJOE
-    /* Identical code, but lots of different upload variations */
-    if (datacrc == 0x38a2 && command_buffer[i+6] == 0x60)
-      detected_loader = FL_GI_JOE;
-#endif
-  }
+  for (i=0;i<command_buffer[5];i++) {
+    uint8_t data = command_buffer[i+6];
 
-  /* Figure out the fastloader based on the current CRC */
-  const struct fastloader_crc_s *crcptr = fl_crc_table;
-  uint8_t loader;
+    datacrc = crc16_update(datacrc, data);
+    for (j=0;j<chunkcrc_count;j++)
+      chunkcrc[j] = crc16_update(chunkcrc[j], data);
 
-  while ( (loader = pgm_read_byte(&crcptr->loadertype)) != FL_NONE ) {
-    if (datacrc == pgm_read_word(&crcptr->crc))
-      break;
+    loader = find_prefix(datacrc, data);
+    for (j=0;j<chunkcrc_count && loader == FL_NONE;j++)
+      loader = find_prefix(chunkcrc[j], data);
 
-    crcptr++;
+    if (loader != FL_NONE)
+      detected_loader = loader;
   }
 
+  /* Figure out the fastloader based on the CRCs of the current upload */
+  crcptr = find_crc(datacrc);
+  for (j=0;j<chunkcrc_count && crcptr == NULL;j++)
+    crcptr = find_crc(chunkcrc[j]);
+
+  loader = FL_NONE;
+  if (crcptr != NULL)
+    loader = pgm_read_byte(&crcptr->loadertype);
+
   /* Set RX/TX function pointers */
   if (loader != FL_NONE) {
     detected_loader = loader;
@@ -1367,9 +1445,20 @@ static void handle_memwrite(void) {
 #endif
 
   if (detected_loader == FL_NONE) {
-    uart_puts_P(PSTR("M-W CRC result: "));
+    /* report enough to add a table entry for an unknown loader */
+    uart_puts_P(PSTR("M-W "));
+    uart_puthex(address >> 8);
+    uart_puthex(address & 0xff);
+    uart_putc('+');
+    uart_puthex(length);
+    uart_puts_P(PSTR(" CRC result: "));
     uart_puthex(datacrc >> 8);
     uart_puthex(datacrc & 0xff);
+    for (j=0;j<chunkcrc_count;j++) {
+      uart_putc('/');
+      uart_puthex(chunkcrc[j] >> 8);
+      uart_puthex(chunkcrc[j] & 0xff);
+    }
     uart_putcrlf();
   }
 }
@@ -1819,6 +1908,7 @@ static void parse_timewrite(void) {
   }
 
   set_rtc(&time);
+  rtc_cache_invalidate();
 }
 
 /* --- T subparser --- */
@@ -1850,7 +1940,7 @@ static void parse_user(void) {
   uint8_t c = command_buffer[1] & 15;
   switch (c) {
   case 0:
-    /* U0 - only device address changes for now */
+    /* U0 - device address change or burst command */
     if ((command_buffer[2] & 0x1f) == 0x1e &&
         command_buffer[3] >= 4 &&
         command_buffer[3] <= 30) {
@@ -1858,6 +1948,12 @@ static void parse_user(void) {
       display_address(device_address);
       lcd_update_device_addr();
       break;
+#ifdef CONFIG_FAST_SERIAL
+    } else if (command_length > 2 &&
+               (command_buffer[2] & 0x1f) != 0x1e &&
+               (iec_data.iecflags & FASTSER_HOST)) {
+      burst_command();
+#endif
     } else {
       set_error(ERROR_SYNTAX_UNKNOWN);
     }
@@ -1921,6 +2017,40 @@ static void parse_user(void) {
 /* ------------ */
 /*  X commands  */
 /* ------------ */
+#ifdef CONFIG_FAT_DEFRAG
+/* --- XF - check/defragment a FAT file --- */
+static void parse_fragments(void) {
+  path_t path;
+  cbmdirent_t dent;
+  uint8_t *str, *name;
+  uint8_t rewrite = 0;
+
+  str = command_buffer + 2;
+  if (*str == '+') {
+    rewrite = 1;
+    str++;
+  }
+
+  if (parse_path(str, &path, &name, 0))
+    return;
+
+  if (partition[path.part].fop != &fatops) {
+    set_error(ERROR_SYNTAX_UNABLE);
+    return;
+  }
+
+  if (first_match(&path, name, FLAG_HIDDEN, &dent))
+    return;
+
+  if (dent.opstype != OPSTYPE_FAT && dent.opstype != OPSTYPE_FAT_X00) {
+    set_error(ERROR_SYNTAX_UNABLE);
+    return;
+  }
+
+  fat_defrag(&path, &dent, rewrite);
+}
+#endif
+
 static void parse_xcommand(void) {
   uint8_t num;
   uint8_t *str;
@@ -2006,6 +2136,13 @@ static void parse_xcommand(void) {
 #endif
     break;
 
+#ifdef CONFIG_FAT_DEFRAG
+  case 'F':
+    /* Check or rewrite the fragmentation of a file */
+    parse_fragments();
+    break;
+#endif
+
   case 'I':
     /* image-as-directory mode */
     str = command_buffer + 2;
@@ -39,8 +39,7 @@
 /*  data structures, constants, global variables                             */
 /* ------------------------------------------------------------------------- */
 
-/* avoid writing unchanged bytes to the EEPROM  */
-/* currently implemented only for the directory */
+/* avoid writing unchanged bytes to the EEPROM */
 #define EEPROMFS_MINIMIZE_WRITES
 
 /* a buffer with at least 32 bytes */
@@ -87,6 +86,12 @@ _Static_assert(EEPROMFS_ENTRIES < 256, "eepromfs must have less than 256 directo
 static uint8_t used_sectors[(SECTOR_COUNT + 7) / 8];
 static uint8_t used_entries[(EEPROMFS_ENTRIES + 7) / 8];
 static uint8_t free_sectors;
+static uint8_t alloc_hint;
+
+/* write-back copy of the directory entry of a file being written */
+static nameentry_t shadow_entry;
+static uint8_t     shadow_index = 0xff;
+static bool        shadow_dirty;
 
 static nameentry_t *nameptr = (nameentry_t *)EEPROMFS_BUFFER;
 static listentry_t *listptr = (listentry_t *)EEPROMFS_BUFFER;
@@ -107,70 +112,122 @@ static bool get_bit(uint8_t *bitmap, uint8_t bit) {
 }
 
 /**
- * read_entry - read a directory entry
- * @index: index of the directory entry
+ * update_block - write data to the EEPROM
+ * @src : pointer to the data
+ * @addr: EEPROM address to write to
+ * @len : number of bytes to write
  *
- * This function reads the directory entry @index
- * from the EEPROM into the buffer.
+ * This function writes @len bytes from @src to the EEPROM at @addr.
+ * With EEPROMFS_MINIMIZE_WRITES only the bytes that differ from the
+ * current EEPROM contents are written.
  */
-static void read_entry(uint8_t index) {
-  eeprom_read_block(EEPROMFS_BUFFER,
-                    (uint8_t *)(EEPROMFS_OFFSET + sizeof(nameentry_t) * index),
-                    sizeof(nameentry_t));
-}
-
-/**
- * write_entry - write a directory entry
- * @index: index of the directory entry
- *
- * This function writes the directory entry @index
- * from the buffer into the EEPROM.
- */
-static void write_entry(uint8_t index) {
+static void update_block(uint8_t *src, uint8_t *addr, uint8_t len) {
 #ifdef EEPROMFS_MINIMIZE_WRITES
   /* write just the changed bytes to the EEPROM */
 
   uint8_t *orig = EEPROMFS_CMP_BUFFER;
-  uint8_t i, nonmatch_start;
-  bool cur_nonmatching = false;
 
-  /* read current entry to minimize writes */
-  eeprom_read_block(orig,
-                    (uint8_t *)(EEPROMFS_OFFSET + sizeof(nameentry_t) * index),
-                    sizeof(nameentry_t));
+  while (len > 0) {
+    uint8_t i, nonmatch_start = 0;
+    uint8_t chunk = len < 32 ? len : 32;
+    bool cur_nonmatching = false;
 
-  for (i = 0; i < sizeof(nameentry_t); i++) {
-    if (cur_nonmatching) {
-      if (EEPROMFS_BUFFER[i] == orig[i]) {
-        cur_nonmatching = false;
+    /* read current contents to minimize writes */
+    eeprom_read_block(orig, addr, chunk);
+
+    for (i = 0; i < chunk; i++) {
+      if (cur_nonmatching) {
+        if (src[i] == orig[i]) {
+          cur_nonmatching = false;
 
-        eeprom_write_block(EEPROMFS_BUFFER + nonmatch_start,
-                             (uint8_t *)(EEPROMFS_OFFSET + sizeof(nameentry_t) * index + nonmatch_start),
+          eeprom_write_block(src + nonmatch_start, addr + nonmatch_start,
                              i - nonmatch_start);
-      }
-    } else {
-      if (EEPROMFS_BUFFER[i] != orig[i]) {
-        cur_nonmatching = true;
-        nonmatch_start  = i;
+        }
+      } else {
+        if (src[i] != orig[i]) {
+          cur_nonmatching = true;
+          nonmatch_start  = i;
+        }
       }
     }
-  }
 
-  if (cur_nonmatching) {
-    /* final block */
-    eeprom_write_block(EEPROMFS_BUFFER + nonmatch_start,
-                       (uint8_t *)(EEPROMFS_OFFSET + sizeof(nameentry_t) * index + nonmatch_start),
-                       sizeof(nameentry_t) - nonmatch_start);
+    if (cur_nonmatching) {
+      /* final block */
+      eeprom_write_block(src + nonmatch_start, addr + nonmatch_start,
+                         chunk - nonmatch_start);
+    }
+
+    src  += chunk;
+    addr += chunk;
+    len  -= chunk;
   }
 
 #else
   /* write everything */
-  eeprom_write_block(EEPROMFS_BUFFER,
-                     (uint8_t *)(EEPROMFS_OFFSET + sizeof(nameentry_t) * index),
-                     sizeof(nameentry_t));
+  eeprom_write_block(src, addr, len);
 #endif
 }
 
+/**
+ * flush_shadow - commit the shadowed directory entry
+ *
+ * This function writes the shadowed directory entry
+ * to the EEPROM if it has been changed.
+ */
+static void flush_shadow(void) {
+  if (shadow_dirty) {
+    update_block((uint8_t *)&shadow_entry,
+                 (uint8_t *)(EEPROMFS_OFFSET + sizeof(nameentry_t) * shadow_index),
+                 sizeof(nameentry_t));
+    shadow_dirty = false;
+  }
+}
+
+/**
+ * read_entry - read a directory entry
+ * @index: index of the directory entry
+ *
+ * This function reads the directory entry @index
+ * from the shadow or the EEPROM into the buffer.
+ */
+static void read_entry(uint8_t index) {
+  if (index == shadow_index)
+    memcpy(EEPROMFS_BUFFER, &shadow_entry, sizeof(nameentry_t));
+  else
+    eeprom_read_block(EEPROMFS_BUFFER,
+                      (uint8_t *)(EEPROMFS_OFFSET + sizeof(nameentry_t) * index),
+                      sizeof(nameentry_t));
+}
+
+/**
+ * defer_entry - change a directory entry in the shadow
+ * @index: index of the directory entry
+ *
+ * This function copies the directory entry @index from the buffer
+ * into the shadow without writing it to the EEPROM. A different
+ * entry that is still in the shadow is committed first.
+ */
+static void defer_entry(uint8_t index) {
+  if (index != shadow_index)
+    flush_shadow();
+
+  memcpy(&shadow_entry, EEPROMFS_BUFFER, sizeof(nameentry_t));
+  shadow_index = index;
+  shadow_dirty = true;
+}
+
+/**
+ * write_entry - write a directory entry
+ * @index: index of the directory entry
+ *
+ * This function writes the directory entry @index
+ * from the buffer into the EEPROM.
+ */
+static void write_entry(uint8_t index) {
+  defer_entry(index);
+  flush_shadow();
+}
+
 /**
  * curentry_is_listentry - checks if the current entry is a listentry
  *
@@ -219,14 +276,15 @@ static void mark_sector(uint8_t sector, bool used) {
 
 /**
  * next_free_sector - find the next free sector
- * @start: sector to start the search at
  *
- * This function searches for the next free sector, starting
- * at @start (to allow some small amount of wear-levelling).
- * Returns a sector number or SECTOR_FREE if none is available.
+ * This function searches for the next free sector, starting after
+ * the most recently allocated one so that all sectors are used in
+ * turn to spread the wear. Returns a sector number or SECTOR_FREE
+ * if none is available.
  */
-static uint8_t next_free_sector(uint8_t start) {
-  uint8_t cur = start;
+static uint8_t next_free_sector(void) {
+  uint8_t start = alloc_hint;
+  uint8_t cur   = start;
 
   while (get_bit(used_sectors, cur)) {
     cur++;
@@ -237,6 +295,10 @@ static uint8_t next_free_sector(uint8_t start) {
       return SECTOR_FREE;
   }
 
+  alloc_hint = cur + 1;
+  if (alloc_hint == SECTOR_COUNT)
+    alloc_hint = 0;
+
   return cur;
 }
 
@@ -312,6 +374,9 @@ void eepromfs_init(void) {
   uint8_t i, j;
 
   free_sectors = SECTOR_COUNT;
+  alloc_hint   = 0;
+  shadow_index = 0xff;
+  shadow_dirty = false;
   memset(used_sectors, 0, sizeof(used_sectors));
   memset(used_entries, 0, sizeof(used_entries));
 
@@ -325,8 +390,13 @@ void eepromfs_init(void) {
 
       /* mark their sectors as used */
       for (j = 0; j < curentry_max_sectors(); j++) {
-        if (listptr->sectors[j] != SECTOR_FREE)
+        if (listptr->sectors[j] != SECTOR_FREE) {
           mark_sector(listptr->sectors[j], true);
+
+          /* continue allocating after the highest used sector */
+          if (listptr->sectors[j] >= alloc_hint)
+            alloc_hint = (listptr->sectors[j] + 1) % SECTOR_COUNT;
+        }
       }
     }
   }
@@ -428,7 +498,7 @@ eefs_error_t eepromfs_open(uint8_t *name, eefs_fh_t *fh, uint8_t flags) {
     memcpy(nameptr->name, name, EEFS_NAME_LENGTH);
     nameptr->size  = 0;
     nameptr->flags = 0;
-    write_entry(fh->entry);
+    defer_entry(fh->entry);
 
   } else {
     /* read, append: return error if the file does not exist */
@@ -494,7 +564,7 @@ eefs_error_t eepromfs_write(eefs_fh_t *fh, void *data, uint16_t length, uint16_t
   while (length > 0) {
     if (fh->cur_soffset == 0) {
       /* need to allocate another sector */
-      uint8_t next_sector = next_free_sector(fh->cur_sector);
+      uint8_t next_sector = next_free_sector();
 
       if (next_sector == SECTOR_FREE)
         return EEFS_ERROR_DISKFULL;
@@ -514,7 +584,7 @@ eefs_error_t eepromfs_write(eefs_fh_t *fh, void *data, uint16_t length, uint16_t
 
         /* write link */
         listptr->nextentry = next_entry;
-        write_entry(fh->cur_entry);
+        defer_entry(fh->cur_entry);
 
         /* build new entry in buffer */
         memset(listptr, 0xff, sizeof(listentry_t));
@@ -527,15 +597,15 @@ eefs_error_t eepromfs_write(eefs_fh_t *fh, void *data, uint16_t length, uint16_t
       /* mark sector as used in internal bookkeeping */
       mark_sector(next_sector, true);
 
-      /* write new sector number to direntry */
+      /* add new sector number to direntry, committed on close */
       listptr->sectors[fh->cur_sindex] = next_sector;
-      write_entry(fh->cur_entry);
+      defer_entry(fh->cur_entry);
     }
 
     uint8_t bytes_to_write = min(length, EEPROMFS_SECTORSIZE - fh->cur_soffset);
-    eeprom_write_block(bdata,
-                       (uint8_t *)(DATA_OFFSET + EEPROMFS_SECTORSIZE * fh->cur_sector + fh->cur_soffset),
-                       bytes_to_write);
+    update_block(bdata,
+                 (uint8_t *)(DATA_OFFSET + EEPROMFS_SECTORSIZE * fh->cur_sector + fh->cur_soffset),
+                 bytes_to_write);
 
     /* adjust state */
     bdata           += bytes_to_write;
@@ -620,9 +690,8 @@ eefs_error_t eepromfs_read(eefs_fh_t *fh, void *data, uint16_t length, uint16_t
  * No return value.
  */
 void eepromfs_close(eefs_fh_t *fh) {
-  // FIXME: Read mode check could be removed if write_entry only writes changed bytes (EEPROMFS_MINIMIZE_WRITES)
   if (fh->filemode != EEFS_MODE_READ) {
-    /* write new file length */
+    /* write new file length together with the deferred entries */
     read_entry(fh->entry);
     nameptr->size = fh->size;
     write_entry(fh->entry);
@@ -79,6 +79,8 @@ static const PROGMEM uint8_t messages[] = {
     0,'S',' ','S','C','R','A','T','C','H','E','D',
   EC(02),
     8,9,
+  EC(04),
+    'F','R','A','G','M','E','N','T','S',
   EC(20), EC(21), EC(22), EC(23), EC(24), EC(27),
     1,3,
   EC(25), EC(28),
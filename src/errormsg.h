@@ -45,6 +45,7 @@ uint8_t set_ok_message(buffer_t *buf);
 #define ERROR_SCRATCHED           1
 #define ERROR_PARTITION_SELECTED  2
 #define ERROR_STATUS              3
+#define ERROR_FRAGMENTS           4
 #define ERROR_LONGVERSION         9
 #define ERROR_READ_NOHEADER      20
 #define ERROR_READ_NOSYNC        21
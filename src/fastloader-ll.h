@@ -67,6 +67,11 @@ uint8_t ar6_1581p_get_byte(void);
 
 void n0sdos_send_byte(uint8_t byte);
 
+#ifdef CONFIG_FAST_SERIAL
+void fastser_send_byte(uint8_t byte);
+int16_t fastser_get_byte(void);
+#endif
+
 typedef enum { PARALLEL_DIR_IN = 0,
                PARALLEL_DIR_OUT } parallel_dir_t;
 
@@ -80,6 +85,11 @@ void parallel_set_dir(parallel_dir_t direction);
 # define parallel_set_dir(x) do {} while (0)
 #endif
 
+#ifdef HAVE_PARALLEL_BLOCK
+void parallel_send_block(const uint8_t *data, uint16_t count);
+uint16_t parallel_receive_block(uint8_t *data, uint16_t count, uint8_t *eoi);
+#endif
+
 #endif
 
 #endif
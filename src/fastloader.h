@@ -101,6 +101,10 @@ uint8_t dolphin_putc(uint8_t data, uint8_t with_eoi);
 void load_dolphin(void);
 void save_dolphin(void);
 
+#ifdef CONFIG_FAST_SERIAL
+void burst_command(void);
+#endif
+
 /* functions that are shared between multiple loaders */
 /* currently located in fastloader.c                  */
 int16_t gijoe_read_byte(void);
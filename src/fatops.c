@@ -31,10 +31,12 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "config.h"
+#include "bgtask.h"
 #include "buffers.h"
 #include "d64ops.h"
 #include "diskchange.h"
 #include "diskio.h"
+#include "dirindex.h"
 #include "display.h"
 #include "doscmd.h"
 #include "errormsg.h"
@@ -45,6 +47,8 @@
 #include "p00cache.h"
 #include "parser.h"
 #include "progmem.h"
+#include "remount.h"
+#include "trackcache.h"
 #include "uart.h"
 #include "utils.h"
 #include "ustring.h"
@@ -377,6 +381,53 @@ static uint8_t fat_file_read(buffer_t *buf) {
   return 0;
 }
 
+#ifdef CONFIG_FAT_WRITEBUFFER
+/* Staging area for sequential writes, used by one write buffer at a time */
+static uint8_t   wstage[CONFIG_FAT_WRITEBUFFER];
+static uint16_t  wstage_used;
+static buffer_t *wstage_owner;
+
+/**
+ * wstage_flush - write the staged data of a buffer to its file
+ * @buf: buffer to be worked on
+ *
+ * This function writes any data collected in the staging area for buf
+ * to the associated file. Returns FR_OK if successful, FR_DENIED if the
+ * disk is full or the error code of f_write otherwise.
+ */
+static FRESULT wstage_flush(buffer_t *buf) {
+  FRESULT res;
+  UINT byteswritten;
+
+  if (wstage_owner != buf || wstage_used == 0)
+    return FR_OK;
+
+  res = f_write(&buf->pvt.fat.fh, wstage, wstage_used, &byteswritten);
+  if (res == FR_OK && byteswritten != wstage_used)
+    res = FR_DENIED;
+
+  wstage_used = 0;
+  return res;
+}
+
+/* Release the staging area, staged data is discarded */
+static void wstage_release(buffer_t *buf) {
+  if (wstage_owner == buf) {
+    wstage_owner = NULL;
+    wstage_used  = 0;
+  }
+}
+
+/* Number of bytes staged for buf but not written to the file yet */
+static inline uint16_t wstage_pending(buffer_t *buf) {
+  return (wstage_owner == buf) ? wstage_used : 0;
+}
+#else
+#  define wstage_flush(buf)   FR_OK
+#  define wstage_release(buf) do {} while (0)
+#  define wstage_pending(buf) 0
+#endif
+
 /**
  * write_data - write the current buffer data
  * @buf: buffer to be worked on
@@ -399,10 +450,32 @@ static uint8_t write_data(buffer_t *buf) {
   if(buf->recordlen)
     buf->lastused = buf->recordlen + 1;
 
+#ifdef CONFIG_FAT_WRITEBUFFER
+  if (wstage_owner == buf) {
+    /* Sequential write: collect the data, write it in large chunks */
+    uint8_t  len  = buf->lastused - 1;
+    uint16_t part = sizeof(wstage) - wstage_used;
+
+    if (part > len)
+      part = len;
+
+    memcpy(wstage + wstage_used, buf->data + 2, part);
+    wstage_used += part;
+    res = FR_OK;
+    byteswritten = len;
+
+    if (wstage_used == sizeof(wstage)) {
+      res = wstage_flush(buf);
+      memcpy(wstage, buf->data + 2 + part, len - part);
+      wstage_used = len - part;
+    }
+  } else
+#endif
   res = f_write(&buf->pvt.fat.fh, buf->data+2, buf->lastused-1, &byteswritten);
   if (res != FR_OK) {
     uart_putc('r');
     parse_error(res,1);
+    wstage_release(buf);
     f_close(&buf->pvt.fat.fh);
     free_buffer(buf);
     return 1;
@@ -411,6 +484,7 @@ static uint8_t write_data(buffer_t *buf) {
   if (byteswritten != buf->lastused-1U) {
     uart_putc('l');
     set_error(ERROR_DISK_FULL);
+    wstage_release(buf);
     f_close(&buf->pvt.fat.fh);
     free_buffer(buf);
     return 1;
@@ -420,7 +494,7 @@ static uint8_t write_data(buffer_t *buf) {
   buf->mustflush = 0;
   buf->position  = 2;
   buf->lastused  = 2;
-  buf->fptr      = buf->pvt.fat.fh.fptr - buf->pvt.fat.headersize;
+  buf->fptr      = buf->pvt.fat.fh.fptr + wstage_pending(buf) - buf->pvt.fat.headersize;
 
   return 0;
 }
@@ -436,13 +510,16 @@ static uint8_t fat_file_write(buffer_t *buf) {
   uint32_t fptr;
   uint32_t i = 0;
 
-  fptr = buf->pvt.fat.fh.fsize - buf->pvt.fat.headersize;
+  fptr = buf->pvt.fat.fh.fsize + wstage_pending(buf) - buf->pvt.fat.headersize;
 
   // on a REL file, the fptr will be be at the end of the record we just read.  Reposition.
   if (buf->fptr != fptr) {
-    res = f_lseek(&buf->pvt.fat.fh, buf->pvt.fat.headersize + buf->fptr);
+    res = wstage_flush(buf);
+    if (res == FR_OK)
+      res = f_lseek(&buf->pvt.fat.fh, buf->pvt.fat.headersize + buf->fptr);
     if (res != FR_OK) {
       parse_error(res,1);
+      wstage_release(buf);
       f_close(&buf->pvt.fat.fh);
       free_buffer(buf);
       return 1;
@@ -481,6 +558,7 @@ static uint8_t fat_file_write(buffer_t *buf) {
     if (res != FR_OK) {
       uart_putc('r');
       parse_error(res,1);
+      wstage_release(buf);
       f_close(&buf->pvt.fat.fh);
       free_buffer(buf);
       return 1;
@@ -509,10 +587,22 @@ uint8_t fat_file_seek(buffer_t *buf, uint32_t position, uint8_t index) {
     if (fat_file_write(buf))
       return 1;
 
+  if (wstage_pending(buf)) {
+    FRESULT res = wstage_flush(buf);
+    if (res != FR_OK) {
+      parse_error(res,0);
+      wstage_release(buf);
+      f_close(&buf->pvt.fat.fh);
+      free_buffer(buf);
+      return 1;
+    }
+  }
+
   if (buf->pvt.fat.fh.fsize >= pos) {
     FRESULT res = f_lseek(&buf->pvt.fat.fh, pos);
     if (res != FR_OK) {
       parse_error(res,0);
+      wstage_release(buf);
       f_close(&buf->pvt.fat.fh);
       free_buffer(buf);
       return 1;
@@ -553,7 +643,7 @@ static uint8_t fat_file_sync(buffer_t *buf) {
  * Used as a cleanup-callback for reading and writing.
  */
 static uint8_t fat_file_close(buffer_t *buf) {
-  FRESULT res;
+  FRESULT res, cres;
 
   if (!buf->allocated) return 0;
 
@@ -563,7 +653,12 @@ static uint8_t fat_file_close(buffer_t *buf) {
       return 1;
   }
 
-  res = f_close(&buf->pvt.fat.fh);
+  /* Always close the file so the directory entry matches the written data */
+  res = wstage_flush(buf);
+  wstage_release(buf);
+  cres = f_close(&buf->pvt.fat.fh);
+  if (res == FR_OK)
+    res = cres;
   parse_error(res,1);
   buf->cleanup = callback_dummy;
 
@@ -639,6 +734,8 @@ FRESULT create_file(path_t *path, cbmdirent_t *dent, uint8_t type, buffer_t *buf
 
   x00ext = NULL;
 
+  dirindex_invalidate(path);
+
   ustrcpy(ops_scratch, dent->name);
   x00ext = build_name(ops_scratch, type);
   name = ops_scratch;
@@ -702,6 +799,7 @@ void fat_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer_t *buf
   FRESULT res;
 
   if (append) {
+    dirindex_invalidate(path);
     partition[path->part].fatfs.curr_dir = path->dir.fat;
     res = f_open(&partition[path->part].fatfs, &buf->pvt.fat.fh, dent->pvt.fat.realname, FA_WRITE | FA_OPEN_EXISTING);
     if (dent->opstype == OPSTYPE_FAT_X00)
@@ -725,10 +823,40 @@ void fat_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer_t *buf
   buf->refill    = fat_file_write;
   buf->seek      = fat_file_seek;
 
+#ifdef CONFIG_FAT_WRITEBUFFER
+  /* Use the staging area unless another file is still writing into it */
+  if (wstage_owner == NULL || !wstage_owner->allocated ||
+      wstage_owner->refill != fat_file_write) {
+    wstage_owner = buf;
+    wstage_used  = 0;
+  }
+#endif
+
   /* If no data is written the file should end up with a single 0x0d byte */
   buf->data[2] = 13;
 }
 
+#ifdef CONFIG_FAT_PREALLOC
+/**
+ * fat_preallocate - reserve space for a file that is about to be written
+ * @buf : buffer of the file
+ * @size: expected number of data bytes
+ *
+ * This function passes the expected size of a file that was just
+ * opened for writing to the FAT layer, which reserves a contiguous
+ * run of clusters for it. Clusters that are not used are released
+ * when the file is closed. Buffers that do not belong to a FAT
+ * write file are ignored.
+ */
+void fat_preallocate(buffer_t *buf, uint32_t size) {
+  if (buf->refill != fat_file_write || buf->recordlen)
+    return;
+
+  /* Errors are ignored, clusters will be allocated on demand then */
+  l_preallocate(&buf->pvt.fat.fh, size + buf->pvt.fat.headersize);
+}
+#endif
+
 /**
  * fat_open_rel - creates a rel file.
  * @path  : path of the file
@@ -750,6 +878,7 @@ void fat_open_rel(path_t *path, cbmdirent_t *dent, buffer_t *buf, uint8_t length
     bytesread = 1;
     ops_scratch[0] = length;
   } else {
+    dirindex_invalidate(path);
     partition[path->part].fatfs.curr_dir = path->dir.fat;
     res = f_open(&partition[path->part].fatfs, &buf->pvt.fat.fh, dent->pvt.fat.realname, FA_WRITE | FA_READ | FA_OPEN_EXISTING);
     if (res == FR_OK) {
@@ -795,6 +924,9 @@ uint8_t fat_opendir(dh_t *dh, path_t *path) {
     parse_error(res,1);
     return 1;
   }
+#ifdef CONFIG_FAT_DIRINDEX
+  dh->index = DIRINDEX_NONE;
+#endif
   return 0;
 }
 
@@ -813,6 +945,25 @@ int8_t fat_readdir(dh_t *dh, cbmdirent_t *dent) {
   uint8_t *ptr,*nameptr;
   uint8_t typechar;
 
+#ifdef CONFIG_FAT_DIRINDEX
+  if (dirindex_active(dh)) {
+    uint16_t skip;
+    int8_t ires = dirindex_readdir(dh, dent);
+
+    if (ires <= 0)
+      return ires;
+
+    /* The index is unusable, continue the listing from the FAT */
+    skip = dh->index;
+    dh->index = DIRINDEX_NONE;
+    while (skip--) {
+      ires = fat_readdir(dh, dent);
+      if (ires)
+        return ires;
+    }
+  }
+#endif
+
   finfo.lfn = ops_scratch;
 
   do {
@@ -826,7 +977,8 @@ int8_t fat_readdir(dh_t *dh, cbmdirent_t *dent) {
     }
   } while ((finfo.fname[0] && (finfo.fattrib & AM_VOL)) ||
            (finfo.fname[0] == '.' && finfo.fname[1] == 0) ||
-           (finfo.fname[0] == '.' && finfo.fname[1] == '.' && finfo.fname[2] == 0));
+           (finfo.fname[0] == '.' && finfo.fname[1] == '.' && finfo.fname[2] == 0) ||
+           (finfo.fname[0] && dirindex_is_own(finfo.fname)));
 
   memset(dent, 0, sizeof(cbmdirent_t));
 
@@ -984,6 +1136,7 @@ uint8_t fat_delete(path_t *path, cbmdirent_t *dent) {
   uint8_t *name;
 
   set_dirty_led(1);
+  dirindex_invalidate(path);
   if (dent->pvt.fat.realname[0]) {
     name = dent->pvt.fat.realname;
     p00cache_invalidate();
@@ -1081,6 +1234,7 @@ uint8_t fat_chdir(path_t *path, cbmdirent_t *dent) {
 void fat_mkdir(path_t *path, uint8_t *dirname) {
   FRESULT res;
 
+  dirindex_invalidate(path);
   partition[path->part].fatfs.curr_dir = path->dir.fat;
   pet2asc(dirname);
   res = f_mkdir(&partition[path->part].fatfs, dirname);
@@ -1235,6 +1389,31 @@ uint16_t fat_freeblocks(uint8_t part) {
 }
 
 
+#ifdef CONFIG_FAT_FREECOUNT
+static uint8_t freecount_part;
+static FREECNT freecount_state;
+
+/**
+ * fat_freecount_job - count the free clusters of all partitions
+ *
+ * This background job checks one FAT sector per call, so the free
+ * cluster count of every FAT partition is known before the first
+ * directory listing needs it. Returns true if it must be called again.
+ */
+bool fat_freecount_job(void) {
+  while (freecount_part < max_part) {
+    if (partition[freecount_part].fop == &fatops &&
+        l_countfree(&partition[freecount_part].fatfs, &freecount_state))
+      return true;
+
+    freecount_part++;
+    memset(&freecount_state, 0, sizeof(freecount_state));
+  }
+  return false;
+}
+#endif
+
+
 /**
  * fat_readwrite_sector - simulate direct sector access
  * @buf   : target buffer
@@ -1331,6 +1510,7 @@ void fat_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
   FRESULT res;
   UINT byteswritten;
 
+  dirindex_invalidate(path);
   partition[path->part].fatfs.curr_dir = path->dir.fat;
 
   if (dent->opstype == OPSTYPE_FAT_X00) {
@@ -1388,6 +1568,69 @@ void fat_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
   }
 }
 
+#ifdef CONFIG_FAT_DEFRAG
+/**
+ * fat_defrag - check and optionally defragment a file
+ * @path   : path of the file
+ * @dent   : pointer to cbmdirent with name of the file
+ * @rewrite: rewrite the file into contiguous clusters if non-zero
+ *
+ * This function counts the fragments of the file in dent and reports
+ * the result as "04,FRAGMENTS,before,after" on the error channel.
+ * If rewrite is set, a fragmented file is copied into a freshly
+ * allocated contiguous cluster run, verified and swapped into the
+ * directory entry. All user buffers are closed first because
+ * their file handles would still refer to the old cluster chain.
+ */
+void fat_defrag(path_t *path, cbmdirent_t *dent, uint8_t rewrite) {
+  FIL *fh = &partition[path->part].imagehandle;
+  FRESULT res;
+  DWORD before, after;
+  uint8_t *name;
+
+  if (dent->pvt.fat.realname[0])
+    name = dent->pvt.fat.realname;
+  else {
+    name = dent->name;
+    pet2asc(name);
+  }
+
+  if (rewrite) {
+    free_multiple_buffers(FMB_USER_CLEAN);
+    dirindex_invalidate(path);
+  }
+
+  partition[path->part].fatfs.curr_dir = path->dir.fat;
+  res = f_open(&partition[path->part].fatfs, fh, name,
+               FA_OPEN_EXISTING | FA_READ | (rewrite ? FA_WRITE : 0));
+  if (res != FR_OK) {
+    parse_error(res, 1);
+    return;
+  }
+
+  res = l_getfragments(fh, &before, NULL);
+  after = before;
+  if (res == FR_OK && rewrite && before > 1) {
+    set_dirty_led(1);
+    res = l_defragment(fh);
+    if (res == FR_OK)
+      after = 1;
+    update_leds();
+  }
+
+  if (res != FR_OK) {
+    parse_error(res, !rewrite);
+    return;
+  }
+
+  if (before > 255)
+    before = 255;
+  if (after > 255)
+    after = 255;
+  set_error_ts(ERROR_FRAGMENTS, before, after);
+}
+#endif
+
 /**
  * fatops_init - Initialize fatops module
  * @preserve_path: Preserve the current directory if non-zero
@@ -1398,34 +1641,41 @@ void fat_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
  */
 void fatops_init(uint8_t preserve_path) {
   FRESULT res;
-  uint8_t realdrive,drive,part;
+  DWORD bootsect[CONFIG_MAX_PARTITIONS];
+  uint8_t realdrive,drive,count,i,ldrive;
 
   max_part = 0;
-  drive = 0;
-  part = 0;
-  while (max_part < CONFIG_MAX_PARTITIONS && drive < MAX_DRIVES) {
-    partition[max_part].fop = &fatops;
-
+  for (drive = 0; drive < MAX_DRIVES && max_part < CONFIG_MAX_PARTITIONS; drive++) {
     /* Map drive numbers in just one place */
     realdrive = map_drive(drive);
-    res=f_mount((realdrive * 16) + part, &partition[max_part].fatfs);
 
-    if (!preserve_path)
-      partition[max_part].current_dir.fat = 0;
+    /* Known cards are mounted without scanning the partition table */
+    if (remount_restore(realdrive, preserve_path))
+      continue;
 
-    if (res == FR_OK)
-      max_part++;
-
-    if (res != FR_NOT_READY && res != FR_INVALID_OBJECT && part < 15 &&
-        /* Don't try to mount partitions on an unpartitioned medium */
-        !(res == FR_OK && part == 0))
-      /* Try all partitions */
-      part++;
-    else {
-      /* End of extended partition chain, try next drive */
-      part = 0;
-      drive++;
+    /* Find all file systems on the drive in a single pass */
+    count = CONFIG_MAX_PARTITIONS - max_part;
+    if (count > 15)
+      count = 15;
+    if (f_scan(realdrive, &partition[max_part].fatfs, bootsect, &count) != FR_OK)
+      count = 0;
+
+    for (i = 0; i < count; i++) {
+      /* Logical drive 0 is the unpartitioned medium */
+      ldrive = (realdrive * 16) + (bootsect[i] ? i + 1 : 0);
+
+      partition[max_part].fop = &fatops;
+      res = f_mount_at(ldrive, &partition[max_part].fatfs, bootsect[i]);
+
+      if (!preserve_path)
+        partition[max_part].current_dir.fat = 0;
+
+      if (res == FR_OK) {
+        remount_add(realdrive, ldrive, max_part);
+        max_part++;
+      }
     }
+    remount_save(realdrive);
   }
 
   if (!preserve_path) {
@@ -1438,6 +1688,15 @@ void fatops_init(uint8_t preserve_path) {
   /* Invalidate some caches */
   d64_invalidate();
   p00cache_invalidate();
+  dirindex_reset();
+  trackcache_invalidate(0xff);
+  d64_readahead_invalidate(0xff);
+
+#ifdef CONFIG_FAT_FREECOUNT
+  freecount_part = 0;
+  memset(&freecount_state, 0, sizeof(freecount_state));
+  bgtask_schedule(BGTASK_FAT_FREECOUNT);
+#endif
 
 #ifndef HAVE_HOTPLUG
   if (!max_part) {
@@ -1476,7 +1735,21 @@ uint8_t image_unmount(uint8_t part) {
     display_current_directory(part, ops_scratch);
   }
 
+#ifdef CONFIG_FAT_DIRINDEX
+  if (partition[part].imagewritten) {
+    /* The index holds the old date of the image file */
+    path_t path;
+
+    path.part    = part;
+    path.dir.fat = partition[part].current_dir.fat;
+    dirindex_invalidate(&path);
+    partition[part].imagewritten = 0;
+  }
+#endif
+
   partition[part].fop = &fatops;
+  trackcache_invalidate(part);
+  d64_readahead_invalidate(part);
   res = f_close(&partition[part].imagehandle);
   if (res != FR_OK) {
     parse_error(res,0);
@@ -1575,11 +1848,20 @@ uint8_t image_write(uint8_t part, DWORD offset, void *buffer, uint16_t bytes, ui
   }
 
   res = f_write(&partition[part].imagehandle, buffer, bytes, &byteswritten);
+  d64_readahead_invalidate(part);
   if (res != FR_OK) {
+    trackcache_invalidate(part);
     parse_error(res,1);
     return 2;
   }
 
+  trackcache_write(part, partition[part].imagehandle.fptr - byteswritten,
+                   buffer, byteswritten);
+
+#ifdef CONFIG_FAT_DIRINDEX
+  partition[part].imagewritten = 1;
+#endif
+
   if (byteswritten != bytes)
     return 1;
 
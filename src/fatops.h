@@ -49,6 +49,15 @@ int8_t   fat_readdir(dh_t *dh, cbmdirent_t *dent);
 void     fat_read_sector(buffer_t *buf, uint8_t part, uint8_t track, uint8_t sector);
 void     fat_write_sector(buffer_t *buf, uint8_t part, uint8_t track, uint8_t sector);
 void     format_dummy(uint8_t drive, uint8_t *name, uint8_t *id);
+#ifdef CONFIG_FAT_DEFRAG
+void     fat_defrag(path_t *path, cbmdirent_t *dent, uint8_t rewrite);
+#endif
+#ifdef CONFIG_FAT_PREALLOC
+void     fat_preallocate(buffer_t *buf, uint32_t size);
+#endif
+#ifdef CONFIG_FAT_FREECOUNT
+bool     fat_freecount_job(void);
+#endif
 
 extern const fileops_t fatops;
 extern uint8_t file_extension_mode;
@@ -59,6 +59,9 @@
 #include "ff.h"         /* FatFs declarations */
 #include "diskio.h"     /* Include file for user provided disk functions */
 #include "progmem.h"
+#if _USE_DEFRAG != 0
+#  include "crc.h"
+#endif
 
 
 /*--------------------------------------------------------------------------
@@ -92,6 +95,24 @@ BUF static_buf;
 # define FPBUF (fp->buf)
 #endif
 
+#if !_FS_READONLY
+static
+WORD fat_changes;       /* Incremented on every change of a FAT entry */
+#endif
+
+#if _USE_READAHEAD != 0
+static struct {
+  FATFS *fs;                /* File system of the cached sectors */
+  DWORD sect;               /* First cached sector */
+  BYTE  count;              /* Number of valid sectors, 0: empty */
+  BYTE  data[_READAHEAD_SECTORS * S_MAX_SIZ];
+} readahead;
+
+# define invalidate_readahead() (readahead.count = 0)
+#else
+# define invalidate_readahead() do {} while (0)
+#endif
+
 /*-----------------------------------------------------------------------*/
 /* Change window offset                                                  */
 /*-----------------------------------------------------------------------*/
@@ -120,6 +141,7 @@ BOOL move_window (      /* TRUE: successful, FALSE: failed */
 #if !_FS_READONLY
     BYTE n;
     if (buf->dirty) {                   /* Write back dirty window if needed */
+      invalidate_readahead();
       if (disk_write(ofs->drive, buf->data, wsect, 1) != RES_OK)
         return FALSE;
       buf->dirty = FALSE;
@@ -247,6 +269,60 @@ DWORD get_cluster (     /* 0,>=2: successful, 1: failed */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Allocation map                                                        */
+/*-----------------------------------------------------------------------*/
+
+#if !_FS_READONLY && _USE_ALLOCMAP != 0
+/* Last cluster# of the group that contains clust */
+#define allocmap_last(fs, clust) ((clust) | ((1UL << (fs)->amap_shift) - 1))
+
+static
+void allocmap_mark (
+  FATFS *fs,            /* File system object */
+  DWORD clust,          /* Any cluster# of the group */
+  BYTE full             /* 1: all clusters of the group are in use */
+)
+{
+  DWORD grp = clust >> fs->amap_shift;
+
+
+  if (full)
+    fs->amap[grp / 8] |= 1 << (grp & 7);
+  else
+    fs->amap[grp / 8] &= ~(1 << (grp & 7));
+}
+
+static
+BYTE allocmap_full (    /* !=0: all clusters of the group are in use */
+  FATFS *fs,            /* File system object */
+  DWORD clust           /* Any cluster# of the group */
+)
+{
+  DWORD grp = clust >> fs->amap_shift;
+
+
+  return fs->amap[grp / 8] & (1 << (grp & 7));
+}
+
+static
+BYTE allocmap_scan (    /* Return value for the next call */
+  FATFS *fs,            /* File system object */
+  DWORD clust,          /* Cluster# checked by a sequential scan */
+  BYTE seen             /* !=0: a free cluster was seen in this group */
+)
+{
+  /* Record the group when the scan passes its last cluster */
+  if (clust != allocmap_last(fs, clust) && clust != fs->max_clust - 1)
+    return seen;
+  allocmap_mark(fs, clust, !seen);
+  return 0;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Change a cluster status                                               */
 /*-----------------------------------------------------------------------*/
@@ -264,6 +340,10 @@ BOOL put_cluster (      /* TRUE: successful, FALSE: failed */
   DWORD fatsect;
 
 
+  fat_changes++;                          /* Restarts a sliced free cluster count */
+#if _USE_ALLOCMAP != 0
+  if (!val) allocmap_mark(fs, clust, 0);  /* Group has a free cluster now */
+#endif
   fatsect = fs->fatbase;
   switch (fs->fs_type) {
   case FS_FAT12 :
@@ -344,6 +424,9 @@ DWORD create_chain (    /* 0: No free cluster, 1: Error, >=2: New cluster number
 )
 {
   DWORD cstat, ncl, scl, mcl = fs->max_clust;
+#if _USE_ALLOCMAP != 0
+  DWORD gfirst;
+#endif
 
 
   if (clust == 0) {                       /* Create new chain */
@@ -358,15 +441,31 @@ DWORD create_chain (    /* 0: No free cluster, 1: Error, >=2: New cluster number
   }
 
   ncl = scl;                              /* Start cluster */
+#if _USE_ALLOCMAP != 0
+  gfirst = 0xFFFFFFFF;
+#endif
   for (;;) {
     ncl++;                                /* Next cluster */
     if (ncl >= mcl) {                     /* Wrap around */
       ncl = 2;
       if (ncl > scl) return 0;            /* No free custer */
     }
+#if _USE_ALLOCMAP != 0
+    if (allocmap_full(fs, ncl)) {         /* Skip groups known to be in use */
+      if (scl >= ncl && scl <= allocmap_last(fs, ncl)) return 0;
+      ncl = allocmap_last(fs, ncl);
+      continue;
+    }
+    if (ncl < gfirst || ncl == (ncl & ~allocmap_last(fs, 0)))
+      gfirst = ncl;                       /* First cluster checked in this group */
+#endif
     cstat = get_cluster(fs, ncl);         /* Get the cluster status */
     if (cstat == 0) break;                /* Found a free cluster */
     if (cstat == 1) return 1;             /* Any error occured */
+#if _USE_ALLOCMAP != 0
+    if (gfirst == (ncl & ~allocmap_last(fs, 0)) || gfirst == 2)
+      allocmap_scan(fs, ncl, 0);          /* Whole group checked so far */
+#endif
     if (ncl == scl) return 0;             /* No free custer */
   }
 
@@ -388,6 +487,81 @@ DWORD create_chain (    /* 0: No free cluster, 1: Error, >=2: New cluster number
 
 
 
+#if !_FS_READONLY && (_USE_DEFRAG != 0 || _USE_PREALLOC != 0)
+/*-----------------------------------------------------------------------*/
+/* Find a run of free clusters                                           */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD find_free_run (   /* 0: No run found, 1: Error, >=2: First cluster of the run */
+  FATFS *fs,            /* File system object */
+  DWORD start,          /* Cluster# to start searching at */
+  DWORD count           /* Number of free clusters required */
+)
+{
+  DWORD ncl, cstat, run, scl, mcl = fs->max_clust;
+
+
+  if (start < 2 || start >= mcl) start = 2;
+  ncl = start; run = 0; scl = 0;
+  do {
+#if _USE_ALLOCMAP != 0
+    if (allocmap_full(fs, ncl)) {         /* Skip groups known to be in use */
+      if (start > ncl && start <= allocmap_last(fs, ncl)) return 0;
+      ncl = allocmap_last(fs, ncl);
+      cstat = 2;
+    } else
+#endif
+    cstat = get_cluster(fs, ncl);         /* Get the cluster status */
+    if (cstat == 1) return 1;             /* Any error occured */
+    if (cstat != 0) {
+      run = 0;
+    } else {
+      if (run++ == 0) scl = ncl;
+      if (run == count) return scl;       /* Found a large enough run */
+    }
+    if (++ncl >= mcl) {                   /* Wrap around, runs do not */
+      ncl = 2;
+      run = 0;
+    }
+  } while (ncl != start);
+
+  return 0;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Allocate a run of free clusters as a new chain                        */
+/*-----------------------------------------------------------------------*/
+
+static
+BOOL alloc_run (        /* TRUE: successful, FALSE: failed */
+  FATFS *fs,            /* File system object */
+  DWORD scl,            /* First cluster of the run */
+  DWORD count           /* Number of clusters in the run */
+)
+{
+  DWORD ncl;
+
+
+  for (ncl = scl; ncl < scl + count - 1; ncl++)
+    if (!put_cluster(fs, ncl, ncl + 1)) return FALSE;
+  if (!put_cluster(fs, ncl, 0x0FFFFFFF)) return FALSE;
+  if (fs->free_clust != 0xFFFFFFFF) {
+    fs->free_clust -= count;
+#if _USE_FSINFO
+    fs->fsi_flag = 1;
+#endif
+  }
+  return TRUE;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Get sector# from cluster#                                             */
 /*-----------------------------------------------------------------------*/
@@ -406,6 +580,34 @@ DWORD clust2sect (      /* !=0: sector number, 0: failed - invalid cluster# */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Check if a cluster chain is contiguous                                */
+/*-----------------------------------------------------------------------*/
+
+static
+BYTE check_contiguous ( /* 1: chain is contiguous and covers size, 0: not */
+  FATFS *fs,            /* File system object */
+  DWORD clust,          /* Start cluster of the chain */
+  DWORD size            /* Number of bytes the chain must hold */
+)
+{
+  DWORD next, csize = (DWORD)fs->csize * SS(fs);
+
+
+  if (clust == 0) return 1;               /* No chain yet */
+  for (;;) {
+    size = (size > csize) ? size - csize : 0;
+    next = get_cluster(fs, clust);
+    if (next < 2 || next >= fs->max_clust) break;   /* End of chain or error */
+    if (next != clust + 1) return 0;
+    clust = next;
+  }
+  return (next != 1 && size == 0);
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Move directory pointer to next                                        */
 /*-----------------------------------------------------------------------*/
@@ -811,6 +1013,7 @@ FRESULT reserve_direntry (  /* FR_OK: successful, FR_DENIED: no free entry, FR_R
   /* Cleanup the expanded table */
   FSBUF.sect = sector = clust2sect(fs, clust);
   memset(FSBUF.data, 0, SS(fs));
+  invalidate_readahead();
   for (n = fs->csize; n; n--) {
     if (disk_write(fs->drive, FSBUF.data, sector, 1) != RES_OK)
       return FR_RW_ERROR;
@@ -878,6 +1081,9 @@ BYTE check_fs (     /* 0:The FAT boot record, 1:Valid boot record but not a FAT,
 /* Mount a drive                                                         */
 /*-----------------------------------------------------------------------*/
 
+static
+FRESULT init_fs(FATFS* fs, BYTE fmt, DWORD bootsect);
+
 FRESULT mount_drv(
   BYTE drv,
   FATFS* fs,
@@ -886,9 +1092,13 @@ FRESULT mount_drv(
 {
   DSTATUS stat;
   BYTE fmt, *tbl;
-  DWORD bootsect, fatsize, totalsect, maxclust;
+  DWORD bootsect;
+#if _MULTI_PARTITION != 0
+  DWORD fatsize;
+#endif
 
   memset(fs, 0, sizeof(FATFS));       /* Clean-up the file system object */
+  invalidate_readahead();
   fs->drive = LD2PD(drv);             /* Bind the logical drive and a physical drive */
   stat = disk_initialize(fs->drive);  /* Initialize low level disk I/O layer */
   if (stat & STA_NOINIT)              /* Check if the drive is ready */
@@ -978,6 +1188,25 @@ FRESULT mount_drv(
 
 #endif
 
+  return init_fs(fs, fmt, bootsect);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Initialize a file system object from its boot sector                  */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT init_fs(
+  FATFS* fs,            /* File system object, boot sector in FSBUF */
+  BYTE fmt,             /* Result of check_fs for the boot sector */
+  DWORD bootsect        /* Boot sector (lba) */
+)
+{
+  DWORD fatsize, totalsect, maxclust;
+
   if (fmt || LD_WORD(&FSBUF.data[BPB_BytsPerSec]) != SS(fs)) { /* No valid FAT patition is found */
     if (fmt == 255) {
       /* At end of extended partition chain */
@@ -1003,6 +1232,11 @@ FRESULT mount_drv(
     - LD_WORD(&FSBUF.data[BPB_RsvdSecCnt]) - fatsize - fs->n_rootdir / (SS(fs)/32)
     ) / fs->csize + 2;
 
+#if !_FS_READONLY && _USE_ALLOCMAP != 0
+  while ((maxclust >> fs->amap_shift) >= _ALLOCMAP_BYTES * 8)
+    fs->amap_shift++;                 /* Clusters per allocation map bit */
+#endif
+
   fmt = FS_FAT12;                     /* Determine the FAT sub type */
   if (maxclust >= 0xFF7) fmt = FS_FAT16;
   if (maxclust >= 0xFFF7) fmt = FS_FAT32;
@@ -1032,6 +1266,7 @@ FRESULT mount_drv(
 # endif
 #endif
   fs->fs_type = fmt;      /* FAT syb-type */
+  fs->bootsect = bootsect;
   //fs->id = ++fsid;                    /* File system mount ID */
   return FR_OK;
 }
@@ -1393,6 +1628,190 @@ FRESULT f_mount (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Mount a Logical Drive at a known boot sector                          */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_mount_at (
+  BYTE drv,       /* Logical drive number to be mounted */
+  FATFS *fs,      /* Pointer to new file system object */
+  DWORD bootsect  /* Boot sector (lba) found by an earlier f_mount */
+)
+{
+#if _USE_DRIVE_PREFIX != 0
+  if (drv >= _LOGICAL_DRIVES) return FR_INVALID_DRIVE;
+
+  if (FatFs[drv]) FatFs[drv]->fs_type = 0;  /* Clear old object */
+
+  FatFs[drv] = fs;      /* Register new object */
+#endif
+
+  /* Same as mount_drv, but skips the drive initialisation */
+  /* and the partition table walk                          */
+  memset(fs, 0, sizeof(FATFS));
+  invalidate_readahead();
+  fs->drive = LD2PD(drv);
+  if (disk_status(fs->drive) & STA_NOINIT)
+    return FR_NOT_READY;
+
+  return init_fs(fs, check_fs(fs, bootsect), bootsect);
+}
+
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Find all FAT file systems on a drive                                  */
+/*-----------------------------------------------------------------------*/
+
+static const PROGMEM UCHAR gptstring[] = "EFI PART";
+
+/* Append sect to the list if it holds a FAT boot record */
+static
+BYTE scan_add (
+  FATFS *fs,        /* File system object used as work area */
+  DWORD sect,       /* Sector# (lba) to check */
+  DWORD *list,      /* List of boot sectors found so far */
+  BYTE n,           /* Number of entries in the list */
+  BYTE max          /* Size of the list */
+)
+{
+  if (n < max && check_fs(fs, sect) == 0 &&
+      LD_WORD(&FSBUF.data[BPB_BytsPerSec]) == SS(fs))
+    list[n++] = sect;
+  return n;
+}
+
+/* Add the file systems listed in a GUID partition table */
+static
+BYTE scan_gpt (
+  FATFS *fs,        /* File system object used as work area */
+  DWORD *list,      /* List of boot sectors found so far */
+  BYTE n,           /* Number of entries in the list */
+  BYTE max          /* Size of the list */
+)
+{
+  DWORD sect, entries, size, first[S_MAX_SIZ / 128];
+  WORD pos;
+  BYTE i, found, used, *ent;
+
+  if (!move_fs_window(fs, 1) ||
+      memcmp_P(&FSBUF.data[GPT_Signature], gptstring, 8))
+    return n;
+  sect    = LD_DWORD(&FSBUF.data[GPT_EntryLBA]);
+  entries = LD_DWORD(&FSBUF.data[GPT_NumEntries]);
+  size    = LD_DWORD(&FSBUF.data[GPT_EntrySize]);
+  if (LD_DWORD(&FSBUF.data[GPT_EntryLBA+4]) || size < 128 ||
+      size > SS(fs) || SS(fs) % size)
+    return n;
+
+  while (entries && n < max) {
+    if (!move_fs_window(fs, sect++))
+      break;
+    /* Checking a partition reuses the buffer, collect a sector first */
+    found = used = 0;
+    for (pos = 0; pos < SS(fs) && entries; pos += size, entries--) {
+      ent = &FSBUF.data[pos];
+      for (i = 0; i < 16 && !ent[i]; i++) ;
+      if (i == 16)                      /* Unused entry (zero type GUID) */
+        continue;
+      used = 1;
+      if (!LD_DWORD(&ent[GPTE_FirstLBA+4]))  /* Skip partitions beyond 2TB */
+        first[found++] = LD_DWORD(&ent[GPTE_FirstLBA]);
+    }
+    if (!used)    /* Partitioning tools fill the table from the start */
+      break;
+    for (i = 0; i < found; i++)
+      n = scan_add(fs, first[i], list, n, max);
+  }
+  return n;
+}
+
+FRESULT f_scan (
+  BYTE pd,        /* Physical drive number */
+  FATFS *fs,      /* File system object used as work area */
+  DWORD *list,    /* Array that receives the boot sectors (lba) found */
+  BYTE *count     /* In: size of the array, out: number of file systems */
+)
+{
+  DWORD start[4], ext, ebr, next, logical;
+  BYTE type[4], i, n, max, *tbl;
+
+  max = *count;
+  *count = 0;
+  memset(fs, 0, sizeof(FATFS));
+  invalidate_readahead();
+  fs->drive = pd;
+  if (disk_initialize(pd) & STA_NOINIT)
+    return FR_NOT_READY;
+#if S_MAX_SIZ > 512
+  if (disk_ioctl(pd, GET_SECTOR_SIZE, &SS(fs)) != RES_OK || SS(fs) > S_MAX_SIZ)
+    return FR_NO_FILESYSTEM;
+#endif
+
+  /* Sector 0 is either an unpartitioned file system or the MBR */
+  i = check_fs(fs, 0);
+  if (i == 2 || !max)
+    return FR_NO_FILESYSTEM;
+  if (i == 0) {
+    list[0] = 0;
+    *count = 1;
+    return FR_OK;
+  }
+
+  for (i = 0; i < 4; i++) {
+    tbl = &FSBUF.data[MBR_Table + i*16];
+    type[i]  = tbl[4];
+    start[i] = LD_DWORD(&tbl[8]);
+  }
+
+  /* Primary partitions */
+  n = 0;
+  ext = 0;
+  for (i = 0; i < 4; i++) {
+    if (type[i] == 0xee) {
+      /* Protective MBR, the partitions are listed in the GPT */
+      n = scan_gpt(fs, list, n, max);
+      ext = 0;
+      break;
+    }
+    if (type[i] == 5 || type[i] == 0x0f) {
+      if (!ext)
+        ext = start[i];
+    } else if (type[i]) {
+      n = scan_add(fs, start[i], list, n, max);
+    }
+  }
+
+  /* Logical drives, the chain of extended partitions is walked only once */
+  ebr = ext;
+  for (i = 0; ebr && n < max && i < (1 << _PARTITION_MASK); i++) {
+    if (!move_fs_window(fs, ebr) ||
+        LD_WORD(&FSBUF.data[BS_55AA]) != 0xAA55)
+      break;
+    next = logical = 0;
+    for (tbl = &FSBUF.data[MBR_Table]; tbl < &FSBUF.data[MBR_Table + 64]; tbl += 16) {
+      if (tbl[4] == 5 || tbl[4] == 0x0f) {
+        if (!next)
+          next = ext + LD_DWORD(&tbl[8]);
+      } else if (tbl[4] && !logical) {
+        logical = ebr + LD_DWORD(&tbl[8]);
+      }
+    }
+    if (!logical)   /* End of extended partition chain */
+      break;
+    n = scan_add(fs, logical, list, n, max);
+    ebr = next;
+  }
+
+  *count = n;
+  return n ? FR_OK : FR_NO_FILESYSTEM;
+}
+
+
+
+
 
 /*-----------------------------------------------------------------------*/
 /* Open or Create a File                                                 */
@@ -1517,6 +1936,14 @@ FRESULT f_open (
   if (mode & (FA_CREATE_ALWAYS|FA_OPEN_ALWAYS|FA_CREATE_NEW))
     sync(fs);                         /* sync buffer in case the file was just created */
                                       /* can't sync earlier, modifies FSBUF.sect       */
+#endif
+  /* Contiguous files are addressed without FAT lookups */
+  fp->contig = check_contiguous(fs, fp->org_clust, fp->fsize);
+#if _USE_READAHEAD != 0
+  fp->seq = 1;
+#endif
+#if _USE_PREALLOC != 0
+  fp->prealloc = 0;
 #endif
   return FR_OK;
 }
@@ -1532,6 +1959,13 @@ FRESULT l_opencluster (
   fp->fsize = (DWORD)fs->csize * SS(fs);
   fp->fptr = 0;
   fp->csect = 1;
+  fp->contig = 0;
+#if _USE_READAHEAD != 0
+  fp->seq = 0;
+#endif
+#if _USE_PREALLOC != 0
+  fp->prealloc = 0;
+#endif
   fp->fs = fs;
 
   return FR_OK;
@@ -1539,6 +1973,270 @@ FRESULT l_opencluster (
 
 
 
+#if _USE_DEFRAG != 0
+/*-----------------------------------------------------------------------*/
+/* Count the number of fragments of a file                               */
+/*-----------------------------------------------------------------------*/
+
+FRESULT l_getfragments (
+  FIL *fp,          /* Pointer to the file object */
+  DWORD *nfrag,     /* Pointer to the variable to return number of fragments */
+  DWORD *nclust     /* Pointer to the variable to return number of clusters */
+)
+{
+  FRESULT res;
+  DWORD clust, next, frags, count;
+  FATFS *fs = fp->fs;
+
+
+  res = validate(fs);
+  if (res != FR_OK) return res;
+
+  frags = 0;
+  count = 0;
+  clust = fp->org_clust;
+  if (clust != 0) {
+    frags = 1;
+    for (;;) {
+      count++;
+      next = get_cluster(fs, clust);
+      if (next == 1) return FR_RW_ERROR;
+      if (next < 2 || next >= fs->max_clust) break;   /* End of chain */
+      if (next != clust + 1) frags++;
+      clust = next;
+    }
+  }
+
+  *nfrag = frags;
+  if (nclust) *nclust = count;
+  return FR_OK;
+}
+
+
+
+#if !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Move a file into a contiguous run of clusters                         */
+/*-----------------------------------------------------------------------*/
+
+FRESULT l_defragment (
+  FIL *fp           /* Pointer to the file object, opened for writing */
+)
+{
+  FRESULT res;
+  DWORD frags, count, scl, ncl, sclust, dclust, nclust;
+  DWORD sect;
+  WORD crc_src, crc_dst;
+  BYTE s, pass;
+  FATFS *fs = fp->fs;
+
+
+  if (!(fp->flag & FA_WRITE)) return FR_DENIED;
+  res = l_getfragments(fp, &frags, &count);
+  if (res != FR_OK) return res;
+  if (frags <= 1) return FR_OK;                       /* Nothing to do */
+
+  /* Find the first free run that is large enough and allocate it */
+  scl = find_free_run(fs, 2, count);
+  if (scl == 1) return FR_RW_ERROR;
+  if (scl == 0) return FR_DENIED;                     /* Volume too fragmented */
+  if (!alloc_run(fs, scl, count)) return FR_RW_ERROR;
+  if (!move_fs_window(fs, 0)) return FR_RW_ERROR;
+
+  invalidate_readahead();
+
+  /* Pass 0 copies the data, pass 1 verifies it by comparing checksums */
+  crc_src = crc_dst = 0xffff;
+  for (pass = 0; pass < 2; pass++) {
+    sclust = fp->org_clust;
+    dclust = scl;
+    while (dclust < scl + count) {
+      nclust = get_cluster(fs, sclust);
+      if (nclust == 1) goto fd_error;
+      for (s = 0; s < fs->csize; s++) {
+        if (pass == 0) {
+          sect = clust2sect(fs, sclust) + s;
+          if (!move_fs_window(fs, sect)) goto fd_error;
+          crc_src = crc_xmodem_block(crc_src, FSBUF.data, SS(fs));
+          if (disk_write(fs->drive, FSBUF.data, clust2sect(fs, dclust) + s, 1) != RES_OK)
+            goto fd_error;
+        } else {
+          sect = clust2sect(fs, dclust) + s;
+          if (!move_fs_window(fs, sect)) goto fd_error;
+          crc_dst = crc_xmodem_block(crc_dst, FSBUF.data, SS(fs));
+        }
+      }
+      sclust = nclust;
+      dclust++;
+    }
+  }
+  if (crc_src != crc_dst) goto fd_error;
+
+  /* Point the directory entry to the new chain and release the old one */
+  if (!move_fs_window(fs, fp->dir_sect)) goto fd_error;
+  ST_WORD(&fp->dir_ptr[DIR_FstClusLO], scl);
+  ST_WORD(&fp->dir_ptr[DIR_FstClusHI], scl >> 16);
+  FSBUF.dirty = TRUE;
+  if (!move_fs_window(fs, 0)) goto fd_error;
+
+  ncl = fp->org_clust;
+  fp->org_clust = scl;
+  fp->fptr = 0;
+  fp->csect = 1;
+  fp->contig = 1;
+  if (!remove_chain(fs, ncl)) return FR_RW_ERROR;
+  fs->last_clust = scl + count - 1;
+  return sync(fs);
+
+fd_error: /* Copy failed, drop the new chain and keep the original file */
+  remove_chain(fs, scl);
+  sync(fs);
+  return FR_RW_ERROR;
+}
+#endif /* !_FS_READONLY */
+#endif /* _USE_DEFRAG */
+
+
+
+
+#if _USE_PREALLOC != 0 && !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Reserve a contiguous cluster chain for a new file                     */
+/*-----------------------------------------------------------------------*/
+
+FRESULT l_preallocate (
+  FIL *fp,          /* Pointer to the file object, opened for writing */
+  DWORD size        /* Expected size of the file in bytes */
+)
+{
+  FRESULT res;
+  DWORD bcs, count, scl, ncl;
+  FATFS *fs = fp->fs;
+
+
+  res = validate(fs);
+  if (res != FR_OK) return res;
+  if (!(fp->flag & FA_WRITE)) return FR_DENIED;
+
+  bcs = (DWORD)fs->csize * SS(fs);
+  count = (size + bcs - 1) / bcs;
+  if (fp->org_clust != 0) {
+    /* Only a file with a single cluster (e.g. a header) can be extended */
+    if (fp->fsize > bcs) return FR_OK;
+    ncl = get_cluster(fs, fp->org_clust);
+    if (ncl == 1) return FR_RW_ERROR;
+    if (ncl < fs->max_clust) return FR_OK;
+    count--;
+  }
+  if (count == 0) return FR_OK;
+  if (fs->free_clust != 0xFFFFFFFF && count > fs->free_clust)
+    return FR_OK;                                     /* Will not fit anyway */
+
+  /* Search behind the last allocation, clusters there are usually free */
+  scl = find_free_run(fs, fp->org_clust ? fp->org_clust : fs->last_clust, count);
+  if (scl == 1) return FR_RW_ERROR;
+  if (scl == 0) return FR_OK;                         /* Allocate on demand */
+  if (!alloc_run(fs, scl, count)) return FR_RW_ERROR;
+
+  if (fp->org_clust == 0) {
+    fp->org_clust = scl;
+    fp->contig = 1;
+  } else {
+    if (!put_cluster(fs, fp->org_clust, scl)) return FR_RW_ERROR;
+    if (scl != fp->org_clust + 1) fp->contig = 0;
+  }
+  fs->last_clust = scl + count - 1;
+  fp->prealloc = 1;
+  fp->flag |= FA__WRITTEN;
+  return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Release preallocated clusters past the end of a file                  */
+/*-----------------------------------------------------------------------*/
+
+static
+BOOL trim_chain (       /* TRUE: successful, FALSE: failed */
+  FIL *fp               /* Pointer to the file object */
+)
+{
+  DWORD clust, ncl, n;
+  FATFS *fs = fp->fs;
+
+
+  fp->prealloc = 0;
+  if (fp->fsize == 0) {                   /* Nothing written, remove all */
+    if (!remove_chain(fs, fp->org_clust)) return FALSE;
+    fp->org_clust = 0;
+  } else {                                /* Find the last cluster in use */
+    n = (fp->fsize - 1) / ((DWORD)fs->csize * SS(fs));
+    clust = fp->org_clust;
+    if (fp->contig) {
+      clust += n;
+    } else {
+      while (n--) {
+        clust = get_cluster(fs, clust);
+        if (clust < 2 || clust >= fs->max_clust) return FALSE;
+      }
+    }
+    ncl = get_cluster(fs, clust);
+    if (ncl < 2) return FALSE;
+    if (ncl < fs->max_clust) {            /* Cut the chain after it */
+      if (!put_cluster(fs, clust, 0x0FFFFFFF)) return FALSE;
+      if (!remove_chain(fs, ncl)) return FALSE;
+    }
+    fs->last_clust = clust;
+  }
+  fp->flag |= FA__WRITTEN;
+  return TRUE;
+}
+#endif
+
+
+
+#if _USE_READAHEAD != 0
+/*-----------------------------------------------------------------------*/
+/* Get the current sector of a file from the read-ahead buffer           */
+/*-----------------------------------------------------------------------*/
+
+static
+BYTE* read_ahead (      /* Pointer to the sector data, NULL: not available */
+  FIL *fp               /* Pointer to the file object */
+)
+{
+  FATFS *fs = fp->fs;
+  DWORD sect = fp->curr_sect, left;
+  BYTE cnt;
+
+
+  if (readahead.count && readahead.fs == fs &&
+      sect >= readahead.sect && sect < readahead.sect + readahead.count)
+    return readahead.data + (sect - readahead.sect) * SS(fs);
+
+  if (!fp->seq) return NULL;            /* Only fill on sequential access */
+
+  /* Sectors left in the file, contiguous files may cross clusters */
+  left = (fp->fsize - (fp->fptr & ~(DWORD)(SS(fs) - 1)) + SS(fs) - 1) / SS(fs);
+  if (!fp->contig && left > fp->csect) left = fp->csect;
+  if (left > _READAHEAD_SECTORS) left = _READAHEAD_SECTORS;
+  cnt = (BYTE)left;
+  if (cnt < 2) return NULL;             /* Single sector, use the window */
+
+  readahead.count = 0;
+  if (disk_read(fs->drive, readahead.data, sect, cnt) != RES_OK)
+    return NULL;
+  readahead.fs    = fs;
+  readahead.sect  = sect;
+  readahead.count = cnt;
+  return readahead.data;
+}
+#endif
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Read File                                                             */
 /*-----------------------------------------------------------------------*/
@@ -1571,8 +2269,12 @@ FRESULT f_read (
       if (--fp->csect) {                        /* Decrement left sector counter */
         sect = fp->curr_sect + 1;               /* Get current sector */
       } else {                                  /* On the cluster boundary, get next cluster */
-        clust = (fp->fptr == 0) ?
-          fp->org_clust : get_cluster(fs, fp->curr_clust);
+        if (fp->fptr == 0)
+          clust = fp->org_clust;
+        else if (fp->contig)                    /* Contiguous file, skip the FAT */
+          clust = fp->curr_clust + 1;
+        else
+          clust = get_cluster(fs, fp->curr_clust);
         if (clust < 2 || clust >= fs->max_clust)
           goto fr_error;
         fp->curr_clust = clust;                 /* Current cluster */
@@ -1597,11 +2299,23 @@ FRESULT f_read (
     if(btr) {  /* if we actually have bytes to read in singles, copy them in */
       rcnt = SS(fs) - ((WORD)fp->fptr & (SS(fs) - 1));       /* Copy fractional bytes from file I/O buffer */
       if (rcnt > btr) rcnt = btr;
+#if _USE_READAHEAD != 0
+      if (FPBUF.sect != fp->curr_sect || FPBUF.fs != fs) {     /* Window has priority, it may be dirty */
+        BYTE *ra = read_ahead(fp);
+        if (ra) {
+          memcpy(rbuff, &ra[fp->fptr & (SS(fs) - 1)], rcnt);
+          continue;
+        }
+      }
+#endif
       if(!move_fp_window(fp,fp->curr_sect)) goto fr_error;   /* are we there or not? */
       memcpy(rbuff, &FPBUF.data[fp->fptr & (SS(fs) - 1)], rcnt);
     }
   }
 
+#if _USE_READAHEAD != 0
+  fp->seq = 1;                          /* Next read continues here */
+#endif
   return FR_OK;
 
 fr_error: /* Abort this file due to an unrecoverable error */
@@ -1648,8 +2362,12 @@ FRESULT f_write (
           clust = fp->org_clust;
           if (clust == 0)                         /* No cluster is created yet */
             fp->org_clust = clust = create_chain(fs, 0);    /* Create a new cluster chain */
+        } else if (fp->contig && fp->fptr < fp->fsize) {
+          clust = fp->curr_clust + 1;             /* Inside a contiguous file */
         } else {                                  /* Middle or end of file */
           clust = create_chain(fs, fp->curr_clust);         /* Trace or streach cluster chain */
+          if (clust != fp->curr_clust + 1)
+            fp->contig = 0;
         }
         if (clust == 0) break;                    /* Disk full */
         if (clust == 1 || clust >= fs->max_clust) goto fw_error;
@@ -1662,6 +2380,7 @@ FRESULT f_write (
       cc = btw / SS(fs);                          /* When left bytes >= SS(fs), */
       if (cc) {                                   /* Write maximum contiguous sectors directly */
         if (cc > fp->csect) cc = fp->csect;
+        invalidate_readahead();
         if (disk_write(fs->drive, wbuff, sect, (BYTE)cc) != RES_OK)
           goto fw_error;
         fp->csect -= (BYTE)(cc - 1);
@@ -1673,6 +2392,16 @@ FRESULT f_write (
     if(btw) {
       wcnt = SS(fs) - ((WORD)fp->fptr & (SS(fs) - 1));  /* Copy fractional bytes to file I/O buffer */
       if (wcnt > btw) wcnt = btw;
+#if _USE_1_BUF != 0
+      if (fp->fptr >= fp->fsize && !(fp->fptr & (SS(fs) - 1)) &&
+          (FPBUF.sect != fp->curr_sect || FPBUF.fs != fs)) {
+        /* New sector after the end of the file, no need to read it */
+        if (!move_fp_window(fp,0)) goto fw_error;
+        memset(FPBUF.data, 0, SS(fs));
+        FPBUF.sect = fp->curr_sect;
+        FPBUF.fs   = fs;
+      } else
+#endif
       if (
 #if _USE_1_BUF == 0
       fp->fptr < fp->fsize &&       /* Fill sector buffer with file data if needed */
@@ -1749,6 +2478,13 @@ FRESULT f_close (
 
 
 #if !_FS_READONLY
+#if _USE_PREALLOC != 0
+  if (fp->prealloc) {
+    res = validate(fp->fs);
+    if (res != FR_OK) return res;
+    if (!trim_chain(fp)) return FR_RW_ERROR;
+  }
+#endif
   res = f_sync(fp);
 #else
   res = validate(fp->fs /*, fp->id*/);
@@ -1780,6 +2516,9 @@ FRESULT f_lseek (
   if (fp->flag & FA__ERROR) return FR_RW_ERROR;
   if (fp->fptr == ofs)        /* Don't seek if the target is the current position */
     return FR_OK;
+#if _USE_READAHEAD != 0
+  fp->seq = 0;
+#endif
   if (!move_fp_window(fp,0)) goto fk_error; /* JLB not sure I need this. */
     if (ofs > fp->fsize                     /* In read-only mode, clip offset with the file size */
 #if !_FS_READONLY
@@ -1798,40 +2537,50 @@ FRESULT f_lseek (
     } else {
       fp->csect = 1;
 
-      if(fp->fptr && ofs > fp->fptr) {
-        fp->fptr = (((DWORD)((fp->fptr-1)/csize))*csize);  /* Set file R/W pointer to start of cluster */
-        ofs-=fp->fptr;            /* subtract off clusters traversed */
-        clust = fp->curr_clust;   /* Get current cluster */
+      if (fp->contig && fp->org_clust && ofs <= fp->fsize) {
+        /* Contiguous file, calculate the target cluster directly */
+        clust = (ofs - 1) / csize;
+        fp->curr_clust = fp->org_clust + clust;
+        fp->fptr = ofs;
+        ofs -= clust * csize;
       } else {
-        fp->fptr = 0;             /* Set file R/W pointer to top of the file */
-        clust = fp->org_clust;    /* Get start cluster */
-      }
+        if(fp->fptr && ofs > fp->fptr) {
+          fp->fptr = (((DWORD)((fp->fptr-1)/csize))*csize);  /* Set file R/W pointer to start of cluster */
+          ofs-=fp->fptr;            /* subtract off clusters traversed */
+          clust = fp->curr_clust;   /* Get current cluster */
+        } else {
+          fp->fptr = 0;             /* Set file R/W pointer to top of the file */
+          clust = fp->org_clust;    /* Get start cluster */
+        }
 
 #if !_FS_READONLY
-      if (clust == 0) {                       /* If the file does not have a cluster chain, create new cluster chain */
-        clust = create_chain(fs, 0);
-        if (clust == 1) goto fk_error;
-        fp->org_clust = clust;
-      }
+        if (clust == 0) {                       /* If the file does not have a cluster chain, create new cluster chain */
+          clust = create_chain(fs, 0);
+          if (clust == 1) goto fk_error;
+          fp->org_clust = clust;
+        }
 #endif
-      if (clust) {                /* If the file has a cluster chain, it can be followed */
-        for (;;) {                                  /* Loop to skip leading clusters */
-          fp->curr_clust = clust;                   /* Update current cluster */
-          if (ofs <= csize) break;
+        if (clust) {                /* If the file has a cluster chain, it can be followed */
+          for (;;) {                                  /* Loop to skip leading clusters */
+            fp->curr_clust = clust;                   /* Update current cluster */
+            if (ofs <= csize) break;
 #if !_FS_READONLY
-          if (fp->flag & FA_WRITE)                  /* Check if in write mode or not */
-            clust = create_chain(fs, clust);        /* Force streached if in write mode */
-          else
-#endif
-            clust = get_cluster(fs, clust);         /* Only follow cluster chain if not in write mode */
-          if (clust == 0) {                         /* Stop if could not follow the cluster chain */
-            ofs = csize; break;
+            if (fp->flag & FA_WRITE) {                /* Check if in write mode or not */
+              clust = create_chain(fs, clust);        /* Force streached if in write mode */
+              if (clust != fp->curr_clust + 1)
+                fp->contig = 0;
+            } else
+#endif
+              clust = get_cluster(fs, clust);         /* Only follow cluster chain if not in write mode */
+            if (clust == 0) {                         /* Stop if could not follow the cluster chain */
+              ofs = csize; break;
+            }
+            if (clust < 2 || clust >= fs->max_clust) goto fk_error;
+            fp->fptr += csize;                        /* Update R/W pointer */
+            ofs -= csize;
           }
-          if (clust < 2 || clust >= fs->max_clust) goto fk_error;
-          fp->fptr += csize;                        /* Update R/W pointer */
-          ofs -= csize;
+          fp->fptr += ofs;                            /* Update file R/W pointer */
         }
-        fp->fptr += ofs;                            /* Update file R/W pointer */
       }
     }
     csect = (CHAR)((ofs - 1) / SS(fs));         /* Sector offset in the cluster */
@@ -2161,7 +2910,10 @@ FRESULT l_getfree (
 {
   FRESULT res;
   DWORD n, clust, sect;
-  BYTE fat, f, *p;
+  BYTE fat, f, isfree, *p;
+#if _USE_ALLOCMAP != 0
+  BYTE seen = 0;
+#endif
 
   /* Get drive number */
   res = auto_mount(&drv, &fs, 0);
@@ -2179,7 +2931,11 @@ FRESULT l_getfree (
   if (fat == FS_FAT12) {
     clust = 2;
     do {
-      if ((WORD)get_cluster(fs, clust) == 0) n++;
+      isfree = ((WORD)get_cluster(fs, clust) == 0);
+      n += isfree;
+#if _USE_ALLOCMAP != 0
+      seen = allocmap_scan(fs, clust, seen | isfree);
+#endif
     } while (++clust < fs->max_clust);
   } else {
     clust = fs->max_clust;
@@ -2195,15 +2951,19 @@ FRESULT l_getfree (
         p = FSBUF.data;
       }
       if (fat == FS_FAT16) {
-        if (LD_WORD(p) == 0) n++;
+        isfree = (LD_WORD(p) == 0);
         p += 2; f += 1;
       } else {
-        if (LD_DWORD(p) == 0) n++;
+        isfree = (LD_DWORD(p) == 0);
         p += 4; f += 2;
       }
+      n += isfree;
+#if _USE_ALLOCMAP != 0
+      seen = allocmap_scan(fs, fs->max_clust - clust, seen | isfree);
+#endif
     } while (--clust);
   }
-  if (n < maxclust) {
+  if (!maxclust || n < maxclust) {      /* Keep the result of a complete scan */
     fs->free_clust = n;
 #if _USE_FSINFO
     if (fat == FS_FAT32) fs->fsi_flag = 1;
@@ -2214,6 +2974,58 @@ FRESULT l_getfree (
   return FR_OK;
 }
 
+/*-----------------------------------------------------------------------*/
+/* Count Free Clusters, one FAT sector per call                          */
+/*-----------------------------------------------------------------------*/
+
+BOOL l_countfree (      /* TRUE: call again, FALSE: count finished or failed */
+  FATFS *fs,            /* Pointer to file system object */
+  FREECNT *fc           /* Count state, set to zero before the first call */
+)
+{
+  DWORD clust, last;
+  WORD step;
+  BYTE *p;
+
+
+  if (!fs->fs_type || fs->free_clust <= fs->max_clust - 2)
+    return FALSE;                       /* Not mounted or already known */
+
+  if (fs->fs_type == FS_FAT12) {        /* Small FAT, count in one go */
+    l_getfree(fs, (const UCHAR*)"", &clust, 0);
+    return FALSE;
+  }
+
+  if (!fc->sect || fc->changes != fat_changes) {
+    fc->sect = 0;                       /* (Re)start, the FAT was changed */
+    fc->count = 0;
+    fc->changes = fat_changes;
+  }
+
+  step = (fs->fs_type == FS_FAT16) ? 2 : 4;
+  clust = fc->sect * (SS(fs) / step);   /* First cluster# of the sector */
+  last = clust + SS(fs) / step;
+  if (last > fs->max_clust) last = fs->max_clust;
+  if (!move_fs_window(fs, fs->fatbase + fc->sect)) return FALSE;
+  for (p = FSBUF.data; clust < last; clust++, p += step) {
+    if (step == 2 ? !LD_WORD(p) : !LD_DWORD(p))
+      fc->count++;
+  }
+  fc->sect++;
+
+  if (last < fs->max_clust)
+    return TRUE;
+
+  fs->free_clust = fc->count;           /* Complete */
+#if _USE_FSINFO
+  if (fs->fs_type == FS_FAT32) fs->fsi_flag = 1;
+#endif
+  return FALSE;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Get Number of Free Clusters                                           */
 /*-----------------------------------------------------------------------*/
@@ -2387,6 +3199,7 @@ FRESULT f_mkdir (
 
   fw = FSBUF.data;
   memset(fw, 0, SS(fs));                       /* Clear the new directory table */
+  invalidate_readahead();
   for (n = 1; n < fs->csize; n++) {
     if (disk_write(fs->drive, fw, ++dsect, 1) != RES_OK)
       return FR_RW_ERROR;
@@ -108,6 +108,44 @@
 /  _USE_DRIVE_PREFIX = 0  */
 #define _USE_DEFERRED_MOUNT 0
 
+/* When _USE_DEFRAG is set to 1, l_getfragments and l_defragment are enabled
+/  to check and rewrite the cluster chain of a file.  */
+#ifdef CONFIG_FAT_DEFRAG
+#define _USE_DEFRAG 1
+#else
+#define _USE_DEFRAG 0
+#endif
+
+/* When _USE_READAHEAD is set to 1, sequential unaligned reads in f_read are
+/  served from a static buffer that is filled with up to _READAHEAD_SECTORS
+/  sectors using a single multi-sector read.  */
+#ifdef CONFIG_FAT_READAHEAD
+#define _USE_READAHEAD 1
+#define _READAHEAD_SECTORS CONFIG_FAT_READAHEAD
+#else
+#define _USE_READAHEAD 0
+#endif
+
+/* When _USE_PREALLOC is set to 1, l_preallocate is enabled to reserve a
+/  contiguous cluster run for a new file.  Unused clusters are released
+/  again when the file is closed.  */
+#ifdef CONFIG_FAT_PREALLOC
+#define _USE_PREALLOC 1
+#else
+#define _USE_PREALLOC 0
+#endif
+
+/* When _USE_ALLOCMAP is set to 1, every file system object keeps a map of
+/  _ALLOCMAP_BYTES bytes with one bit per group of clusters that are known to
+/  be in use.  Free cluster searches skip these groups without reading their
+/  FAT sectors.  */
+#ifdef CONFIG_FAT_ALLOCMAP
+#define _USE_ALLOCMAP 1
+#define _ALLOCMAP_BYTES CONFIG_FAT_ALLOCMAP
+#else
+#define _USE_ALLOCMAP 0
+#endif
+
 /* New features in 0.05a, not required yet */
 #define _USE_TRUNCATE 0
 #define _USE_UTIME   0
@@ -135,6 +173,10 @@
 #define _USE_1_BUF 0
 #endif
 
+#if _USE_READAHEAD != 0 && _USE_1_BUF == 0
+#error _USE_READAHEAD requires _USE_1_BUF
+#endif
+
 typedef struct _BUF {
   DWORD sect;
   BYTE  dirty;              /* dirty flag (1:must be written back) */
@@ -154,12 +196,17 @@ typedef struct _FATFS {
     DWORD   fatbase;        /* FAT start sector */
     DWORD   dirbase;        /* Root directory start sector (cluster# for FAT32) */
     DWORD   database;       /* Data start sector */
+    DWORD   bootsect;       /* Boot sector */
 #if _USE_CHDIR != 0 || _USE_CURR_DIR != 0
     DWORD curr_dir;
 #endif
 #if !_FS_READONLY
     DWORD   last_clust;     /* Last allocated cluster */
     DWORD   free_clust;     /* Number of free clusters */
+#if _USE_ALLOCMAP != 0
+    BYTE    amap_shift;     /* log2 of the clusters per allocation map bit */
+    BYTE    amap[_ALLOCMAP_BYTES];  /* Set bits: all clusters of the group in use */
+#endif
 #if _USE_FSINFO
     DWORD   fsi_sector;     /* fsinfo sector */
     BYTE    fsi_flag;       /* fsinfo dirty flag (1:must be written back) */
@@ -194,6 +241,13 @@ typedef struct _FIL {
   //WORD    id;             /* Owner file system mount ID */
     BYTE    flag;           /* File status flags */
     BYTE    csect;          /* Sector address in the cluster */
+    BYTE    contig;         /* Cluster chain is known to be contiguous */
+#if _USE_READAHEAD != 0
+    BYTE    seq;            /* Last access was a sequential read */
+#endif
+#if _USE_PREALLOC != 0
+    BYTE    prealloc;       /* Cluster chain may extend past the end of file */
+#endif
     FATFS*  fs;             /* Pointer to the owner file system object */
     DWORD   fptr;           /* File R/W pointer */
     DWORD   fsize;          /* File size */
@@ -272,6 +326,8 @@ typedef enum {
 
 #if _USE_DRIVE_PREFIX == 0
 FRESULT f_mount (BYTE, FATFS*);                             /* Mount/Unmount a logical drive */
+FRESULT f_mount_at (BYTE, FATFS*, DWORD);                   /* Mount a logical drive at a known boot sector */
+FRESULT f_scan (BYTE, FATFS*, DWORD*, BYTE*);               /* Find the boot sectors of all file systems on a drive */
 FRESULT f_open (FATFS*, FIL*, const UCHAR*, BYTE);          /* Open or create a file */
 FRESULT f_read (FIL*, void*, UINT, UINT*);                  /* Read data from a file */
 FRESULT f_write (FIL*, const void*, UINT, UINT*);           /* Write data to a file */
@@ -292,6 +348,8 @@ FRESULT f_chdir (FATFS*, const UCHAR*);                     /* Change current di
 #else
 
 FRESULT f_mount (BYTE, FATFS*);                             /* Mount/Unmount a logical drive */
+FRESULT f_mount_at (BYTE, FATFS*, DWORD);                   /* Mount a logical drive at a known boot sector */
+FRESULT f_scan (BYTE, FATFS*, DWORD*, BYTE*);               /* Find the boot sectors of all file systems on a drive */
 FRESULT f_open (FIL*, const UCHAR*, BYTE);                  /* Open or create a file */
 FRESULT f_read (FIL*, void*, UINT, UINT*);                  /* Read data from a file */
 FRESULT f_write (FIL*, const void*, UINT, UINT*);           /* Write data to a file */
@@ -311,10 +369,25 @@ FRESULT f_chdir (const UCHAR*);                             /* Change current di
 
 #endif
 
+/* State of a free cluster count in slices */
+typedef struct _FREECNT {
+    DWORD   sect;           /* Next FAT sector to check, relative to fatbase */
+    DWORD   count;          /* Free clusters found so far */
+    WORD    changes;        /* FAT change counter when the count started */
+} FREECNT;
+
 /* Low Level functions */
 FRESULT l_opendir(FATFS* fs, DWORD cluster, DIR *dirobj);   /* Open an existing directory by its start cluster */
 FRESULT l_opencluster(FATFS *fs, FIL *fp, DWORD clust);     /* Open a cluster by number as a read-only file */
 FRESULT l_getfree (FATFS*, const UCHAR*, DWORD*, DWORD);    /* Get number of free clusters on the drive, limited */
+BOOL l_countfree (FATFS*, FREECNT*);                        /* Count free clusters, one FAT sector per call */
+#if _USE_DEFRAG != 0
+FRESULT l_getfragments (FIL*, DWORD*, DWORD*);              /* Count the fragments and clusters of a file */
+FRESULT l_defragment (FIL*);                                /* Move a file into contiguous clusters */
+#endif
+#if _USE_PREALLOC != 0
+FRESULT l_preallocate (FIL*, DWORD);                        /* Reserve contiguous clusters for a new file */
+#endif
 
 #if _USE_STRFUNC
 #define feof(fp) ((fp)->fptr == (fp)->fsize)
@@ -412,6 +485,12 @@ DWORD get_fattime (void); /* 31-25: Year(0-127 org.1980), 24-21: Month(1-12), 20
 
 #define MBR_Table           446
 
+#define GPT_Signature       0
+#define GPT_EntryLBA        72
+#define GPT_NumEntries      80
+#define GPT_EntrySize       84
+#define GPTE_FirstLBA       32
+
 #define DIR_Name            0
 #define DIR_Attr            11
 #define DIR_NTres           12
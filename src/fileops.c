@@ -39,6 +39,7 @@
 #include "buffers.h"
 #include "d64ops.h"
 #include "dirent.h"
+#include "dirindex.h"
 #include "display.h"
 #include "doscmd.h"
 #include "eefs-ops.h"
@@ -623,6 +624,9 @@ static void load_directory(uint8_t secondary) {
   }
 
 scandone:
+  /* Large FAT directories are listed from their index file */
+  dirindex_opendir(&buf->pvt.dir.dh, &path);
+
   if (secondary != 0) {
     /* Raw directory */
 
@@ -0,0 +1,323 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   fl-burst.c: 1571/1581 burst command set (U0) for C128 fast serial hosts
+
+   All burst transfers from the drive to the host are paced by the host:
+   it toggles CLK to request each byte, which is then sent with fast
+   serial. Data from the host is clocked in on SRQ without handshake.
+   Sector numbers always refer to 256 byte logical sectors of the
+   mounted image.
+
+*/
+
+#include <stdbool.h>
+#include <string.h>
+#include "config.h"
+#include "buffers.h"
+#include "d64ops.h"
+#include "dirent.h"
+#include "doscmd.h"
+#include "errormsg.h"
+#include "fastloader-ll.h"
+#include "fileops.h"
+#include "iec-bus.h"
+#include "iec.h"
+#include "parser.h"
+#include "uart.h"
+#include "wrapops.h"
+#include "fastloader.h"
+
+/* burst status byte, controller status in the low nibble */
+#define BURST_OK            0x00
+#define BURST_NO_HEADER     0x02
+#define BURST_NO_DATA       0x04
+#define BURST_WRITE_PROTECT 0x08
+#define BURST_SYNTAX        0x0e
+#define BURST_NO_DRIVE      0x0f
+#define BURST_EOI           0x1f  /* fastload: last block, length follows */
+#define BURST_MODE_MFM      0x80
+#define BURST_SECTOR_256    0x10
+
+/* low nibble of the command byte */
+#define BURST_CMD_READ      0x00
+#define BURST_CMD_WRITE     0x02
+#define BURST_CMD_INQUIRE   0x04
+#define BURST_CMD_QUERY     0x0a
+#define BURST_CMD_STATUS    0x0c
+#define BURST_CMD_FASTLOAD  0x0f  /* with bit 4 set */
+
+/* flags in the command byte */
+#define BURST_FLAG_NODATA   0x80  /* read: do not transfer data      */
+#define BURST_FLAG_IGNERR   0x40  /* read/write: continue on errors  */
+#define BURST_FLAG_ANYTYPE  0x80  /* fastload: do not require a PRG */
+
+static uint8_t clock_level;
+static uint8_t last_status;
+
+/**
+ * burst_send - send one byte when the host requests it
+ * @byte: data byte
+ *
+ * This function waits until the host toggles CLK and sends byte
+ * with fast serial. Returns false if the transfer was aborted by
+ * ATN or a key press, true otherwise.
+ */
+static bool burst_send(uint8_t byte) {
+  while ((!!IEC_CLOCK) == clock_level)
+    if (!IEC_ATN || check_keys())
+      return false;
+
+  clock_level = !clock_level;
+  fastser_send_byte(byte);
+  set_data(1);
+  return true;
+}
+
+/* Translate current_error to a burst status byte */
+static uint8_t burst_status(void) {
+  switch (current_error) {
+  case ERROR_OK:
+    return BURST_OK;
+
+  case ERROR_WRITE_PROTECT:
+    return BURST_WRITE_PROTECT;
+
+  case ERROR_READ_NODATA:
+  case ERROR_READ_CHECKSUM:
+    return BURST_NO_DATA;
+
+  case ERROR_DRIVE_NOT_READY:
+  case ERROR_IMAGE_INVALID:
+    return BURST_NO_DRIVE;
+
+  default:
+    return BURST_NO_HEADER;
+  }
+}
+
+/**
+ * burst_sectors - handle burst read and write
+ * @cmd  : command byte
+ * @write: true for burst write
+ *
+ * This function transfers command_buffer[5] sectors starting at
+ * track command_buffer[3], sector command_buffer[4]. Each sector read
+ * is sent as a status byte followed by 256 data bytes, each sector
+ * written is received as 256 bytes and acknowledged with a status byte.
+ */
+static void burst_sectors(uint8_t cmd, bool write) {
+  buffer_t *buf;
+  uint8_t track, sector, count, status;
+  uint16_t i;
+
+  if (command_length < 6) {
+    burst_send(BURST_SYNTAX);
+    return;
+  }
+
+  track  = command_buffer[3];
+  sector = command_buffer[4];
+  count  = command_buffer[5];
+
+  buf = alloc_system_buffer();
+  if (buf == NULL) {
+    burst_send(BURST_NO_DRIVE);
+    return;
+  }
+
+  while (count--) {
+    if (write) {
+      for (i = 0; i < 256; i++) {
+        int16_t c = fastser_get_byte();
+        if (c < 0)
+          goto abort;
+        buf->data[i] = c;
+      }
+
+      write_sector(buf, current_part, track, sector);
+      status = last_status = burst_status();
+      if (!burst_send(status))
+        goto abort;
+    } else {
+      read_sector(buf, current_part, track, sector);
+      status = last_status = burst_status();
+      if (!burst_send(status))
+        goto abort;
+
+      if (!(cmd & BURST_FLAG_NODATA) &&
+          (status == BURST_OK || (cmd & BURST_FLAG_IGNERR)))
+        for (i = 0; i < 256; i++)
+          if (!burst_send(buf->data[i]))
+            goto abort;
+    }
+
+    if (status != BURST_OK && !(cmd & BURST_FLAG_IGNERR))
+      break;
+
+    /* the transfer ends with the last sector of the track */
+    if (partition[current_part].fop == &d64ops &&
+        sector + 1 >= d64_sectors_per_track(current_part, track))
+      break;
+
+    sector++;
+  }
+
+ abort:
+  free_buffer(buf);
+}
+
+/**
+ * burst_fastload - handle the burst fastload command
+ * @cmd: command byte
+ *
+ * This function opens the file named after the command byte and sends
+ * it block by block. Each block is preceded by a status byte, the last
+ * one by BURST_EOI and the number of data bytes in it.
+ */
+static void burst_fastload(uint8_t cmd) {
+  buffer_t *buf;
+  path_t path;
+  cbmdirent_t dent;
+  uint8_t *name, count, pos;
+
+  command_buffer[command_length] = 0;
+
+  buf = alloc_system_buffer();
+  if (buf == NULL) {
+    burst_send(BURST_NO_DRIVE);
+    return;
+  }
+
+  if (parse_path(command_buffer + 3, &path, &name, 0) ||
+      first_match(&path, name, (cmd & BURST_FLAG_ANYTYPE) ? 0 : TYPE_PRG, &dent)) {
+    free_buffer(buf);
+    burst_send(BURST_NO_HEADER);
+    return;
+  }
+
+  open_read(&path, &dent, buf);
+  if (current_error != ERROR_OK) {
+    free_buffer(buf);
+    burst_send(burst_status());
+    return;
+  }
+
+  while (1) {
+    count = buf->lastused - 1;
+
+    if (buf->sendeoi) {
+      if (!burst_send(BURST_EOI) || !burst_send(count))
+        break;
+    } else {
+      if (!burst_send(BURST_OK))
+        break;
+    }
+
+    for (pos = 2; count--; pos++)
+      if (!burst_send(buf->data[pos]))
+        goto abort;
+
+    if (buf->sendeoi)
+      break;
+
+    if (buf->refill(buf)) {
+      burst_send(burst_status());
+      break;
+    }
+  }
+
+ abort:
+  cleanup_and_free_buffer(buf);
+}
+
+/**
+ * burst_command - execute a burst command (U0 followed by a command byte)
+ *
+ * This function handles the burst commands of the 1571/1581 for hosts
+ * that announced fast serial support. The U0> utility command is
+ * handled by the caller.
+ */
+void burst_command(void) {
+  uint8_t cmd = command_buffer[2];
+
+  uart_putc('B');
+  clock_level = !!IEC_CLOCK;
+  set_error(ERROR_OK);
+
+  switch (cmd & 0x0f) {
+  case BURST_CMD_READ:
+    burst_sectors(cmd, false);
+    break;
+
+  case BURST_CMD_WRITE:
+    burst_sectors(cmd, true);
+    break;
+
+  case BURST_CMD_INQUIRE:
+    if (current_part >= max_part)
+      last_status = BURST_NO_DRIVE;
+    else
+      last_status = BURST_OK;
+    burst_send(last_status);
+    break;
+
+  case BURST_CMD_QUERY:
+    /* Only D81 images have an MFM format. The layout matches the */
+    /* logical sectors that burst read and write address.         */
+    if (partition[current_part].fop == &d64ops &&
+        (partition[current_part].imagetype & D64_TYPE_MASK) == D64_TYPE_D81) {
+      uint8_t spt = d64_sectors_per_track(current_part, command_buffer[3]);
+
+      if (burst_send(BURST_MODE_MFM | BURST_SECTOR_256) &&
+          burst_send(spt) &&               /* sectors per track    */
+          burst_send(command_buffer[3]) && /* logical track        */
+          burst_send(0) &&                 /* lowest sector number */
+          burst_send(spt - 1))             /* highest sector       */
+        burst_send(1);                     /* interleave           */
+    } else {
+      burst_send(BURST_NO_HEADER);
+    }
+    break;
+
+  case BURST_CMD_STATUS:
+    burst_send(last_status);
+    break;
+
+  case BURST_CMD_FASTLOAD:
+    if ((cmd & 0x1f) == 0x1f) {
+      burst_fastload(cmd);
+      break;
+    }
+    /* fall through */
+
+  default:
+    /* format, track cache dump and utility loader are not supported */
+    burst_send(BURST_SYNTAX);
+    break;
+  }
+
+  /* leave the bus in the idle state */
+  set_data(1);
+  set_srq(1);
+}
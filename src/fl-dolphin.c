@@ -142,18 +142,57 @@ uint8_t dolphin_putc(uint8_t data, uint8_t with_eoi) {
   return 0;
 }
 
-/* send a byte with hardware handshaking */
-static void dolphin_write_hs(uint8_t value) {
-  parallel_write(value);
-  parallel_clear_rxflag();
-  parallel_send_handshake();
+#ifndef HAVE_PARALLEL_BLOCK
+/* generic block transfers, see lpc17xx/llfl-parallel.c for details */
+static void parallel_send_block(const uint8_t *data, uint16_t count) {
+  while (1) {
+    parallel_write(*data++);
+    parallel_clear_rxflag();
+    parallel_send_handshake();
+
+    if (--count == 0)
+      return;
+
+    while (!parallel_rxflag) ;
+  }
+}
+
+static uint16_t parallel_receive_block(uint8_t *data, uint16_t count, uint8_t *eoi) {
+  uint16_t received = 0;
+  uint8_t last;
+
+  do {
+    while (!parallel_rxflag) ;
+
+    data[received++] = parallel_read();
+    last = !!IEC_CLOCK;
+
+    parallel_clear_rxflag();
+    parallel_send_handshake();
+  } while (!last && received < count);
+
+  *eoi = last;
+  return received;
+}
+#endif
+
+/* wait for the acknowledge of the last byte sent */
+static void parallel_wait_ack(void) {
   while (!parallel_rxflag) ;
 }
 
-/* DolphinDOS XQ command */
+/**
+ * load_dolphin - DolphinDOS XQ command
+ *
+ * This function sends the file opened on secondary address 0 over the
+ * parallel cable. The next sector is read while the host still handles
+ * the last byte of the current one, which stays latched on the port,
+ * so reading a sector overlaps with the transfer instead of adding to it.
+ */
 void load_dolphin(void) {
   /* find the already open buffer */
   buffer_t *buf = find_buffer(0);
+  uint8_t res;
 
   if (!buf)
     return;
@@ -173,13 +212,12 @@ void load_dolphin(void) {
   delay_us(100); // experimental delay
 
   /* every sector except the last */
-  uint8_t i;
-
   while (!buf->sendeoi) {
     iec_bus_t bus_state = iec_bus_read();
 
     /* transmit first byte */
-    dolphin_write_hs(buf->data[2]);
+    parallel_send_block(buf->data + 2, 1);
+    parallel_wait_ack();
 
     /* check DATA state before transmission */
     if (bus_state & IEC_BIT_DATA) {
@@ -187,22 +225,21 @@ void load_dolphin(void) {
       return;
     }
 
-    /* transmit the rest of the sector */
-    for (i = 3; i != 0; i++)
-      dolphin_write_hs(buf->data[i]);
+    /* transmit the rest of the sector, read ahead during the last byte */
+    parallel_send_block(buf->data + 3, 253);
+    res = buf->refill(buf);
+    parallel_wait_ack();
 
-    /* read next sector */
-    if (buf->refill(buf)) {
+    if (res) {
       cleanup_and_free_buffer(buf);
       return;
     }
   }
 
-  /* last sector */
-  i = 2;
-  do {
-    dolphin_write_hs(buf->data[i]);
-  } while (i++ < buf->lastused);
+  /* last sector, at least one byte is sent */
+  parallel_send_block(buf->data + 2,
+                      (buf->lastused > 2) ? buf->lastused - 1 : 1);
+  parallel_wait_ack();
 
   /* final handshake */
   set_clock(1);
@@ -213,9 +250,17 @@ void load_dolphin(void) {
   cleanup_and_free_buffer(buf);
 }
 
-/* DolphinDOS XZ command */
+/**
+ * save_dolphin - DolphinDOS XZ command
+ *
+ * This function receives data for the file opened on secondary
+ * address 1 in blocks of up to 254 bytes. Every byte is acknowledged
+ * on arrival, so a full sector is written while the host already
+ * prepares the first byte of the next one.
+ */
 void save_dolphin(void) {
   buffer_t *buf;
+  uint16_t count;
   uint8_t eoi;
 
   /* find the already open file */
@@ -245,23 +290,16 @@ void save_dolphin(void) {
       if (buf->refill(buf))
         return; // FIXME: check error handling in Dolphin
 
-    while (!parallel_rxflag) ;
+    count = parallel_receive_block(buf->data + buf->position,
+                                   256 - buf->position, &eoi);
 
-    buf->data[buf->position] = parallel_read();
     mark_buffer_dirty(buf);
-
-    if (buf->lastused < buf->position)
-      buf->lastused = buf->position;
-    buf->position++;
+    buf->position += count;
+    buf->lastused  = buf->position - 1;
 
     /* mark for flushing on wrap */
     if (buf->position == 0)
       buf->mustflush = 1;
-
-    eoi = !!IEC_CLOCK;
-
-    parallel_clear_rxflag();
-    parallel_send_handshake();
   } while (!eoi);
 
   /* the file will be closed with ATN+0xe1 by DolphinDOS */
@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include "config.h"
 #include "atomic.h"
+#include "bgtask.h"
 #include "buffers.h"
 #include "d64ops.h"
 #include "diskchange.h"
@@ -69,6 +70,16 @@ iec_data_t iec_data;
 /*  Very low-level bus handling                                              */
 /* ------------------------------------------------------------------------- */
 
+#ifdef CONFIG_FAST_SERIAL
+/* A C128 announces fast serial by clocking SRQ while ATN is active */
+static inline void check_fastser_host(void) {
+  if (!IEC_SRQ)
+    iec_data.iecflags |= FASTSER_HOST;
+}
+#else
+static inline void check_fastser_host(void) {}
+#endif
+
 /// Debounce IEC input - see E9C0
 static iec_bus_t iec_debounced(void) {
   iec_bus_t tmp;
@@ -124,6 +135,8 @@ static int16_t _iec_getc(void) {
 
   do {                                                 // E9CD-E9D5
     if (iec_check_atn()) return -1;
+    if (iec_data.bus_state == BUS_ATNACTIVE)
+      check_fastser_host();
   } while (!(iec_debounced() & IEC_BIT_CLOCK));
 
   set_data(1);                                         // E9D7
@@ -348,7 +361,12 @@ static uint8_t iec_listen_handler(const uint8_t cmd) {
       else
         c = iec_getc();
     }
-    if (c < 0) return 1;
+    if (c < 0) {
+      /* ATN holds the bus, write the blocks held back now */
+      if ((cmd & 0xf0) != 0xf0)
+        write_deferred_buffers(buf);
+      return 1;
+    }
 
     if ((cmd & 0x0f) == 0x0f || (cmd & 0xf0) == 0xf0) {
       if (command_length < CONFIG_COMMAND_BUFFER_SIZE)
@@ -357,9 +375,9 @@ static uint8_t iec_listen_handler(const uint8_t cmd) {
         // Filenames are just a special type of command =)
         iec_data.iecflags |= COMMAND_RECVD;
     } else {
-      /* Flush buffer if full */
-      if (buf->mustflush) {
-        if (buf->refill(buf))
+      /* Flush buffer if full, keep receiving while the write is deferred */
+      if (buf->mustflush && !defer_buffer_write(buf)) {
+        if (write_deferred_buffers(buf) || buf->refill(buf))
           return 1;
         /* Search the buffer again, it can change when using large buffers. */
         buf = find_buffer(cmd & 0x0f);
@@ -572,6 +590,7 @@ void iec_mainloop(void) {
     case BUS_SLEEP:
       handle_lcd();
       switch_to_ieee488 = handle_buttons();
+      bgtask_run();
       break;
 
     case BUS_IDLE:  // EBFF
@@ -581,7 +600,9 @@ void iec_mainloop(void) {
       while (IEC_ATN) {
         handle_lcd();
         handle_buttons();
-        system_sleep();
+        /* Background jobs run in short slices, ATN is checked in between */
+        if (!bgtask_run())
+          system_sleep();
       }
 
       if (iec_data.bus_state != BUS_SLEEP)
@@ -596,7 +617,7 @@ void iec_mainloop(void) {
 
       iec_data.device_state = DEVICE_IDLE;
       iec_data.bus_state    = BUS_ATNACTIVE;
-      iec_data.iecflags &= (uint8_t)~(EOI_RECVD | JIFFY_ACTIVE | JIFFY_LOAD);
+      iec_data.iecflags &= (uint8_t)~(EOI_RECVD | JIFFY_ACTIVE | JIFFY_LOAD | FASTSER_HOST);
 
       /* Slight protocol violation:                        */
       /*   Wait until clock is low or 250us have passed    */
@@ -604,13 +625,17 @@ void iec_mainloop(void) {
       /*   before ATN, this loop should keep us in sync.   */
 
       start_timeout(250);
-      while (IEC_CLOCK && !has_timed_out())
+      while (IEC_CLOCK && !has_timed_out()) {
+        check_fastser_host();
         if (IEC_ATN)
           iec_data.bus_state = BUS_ATNPROCESS;
+      }
 
-      while (!IEC_CLOCK)
+      while (!IEC_CLOCK) {
+        check_fastser_host();
         if (IEC_ATN)
           iec_data.bus_state = BUS_ATNPROCESS;
+      }
 
       break;
 
@@ -785,7 +810,7 @@ void iec_mainloop(void) {
 
       /* We're done, clean up unused buffers */
       free_multiple_buffers(FMB_UNSTICKY);
-      d64_bam_commit();
+      bgtask_schedule(BGTASK_BAM_COMMIT);
 
       iec_data.bus_state = BUS_IDLE;
       break;
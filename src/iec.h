@@ -28,6 +28,8 @@
 #ifndef IEC_H
 #define IEC_H
 
+#include <stdbool.h>
+
 /**
  * struct iecflags_t - Bitfield of various flags, mostly IEC-related
  * @eoi_recvd      : Received EOI with the last byte read
@@ -35,6 +37,7 @@
  * @jiffy_active   : JiffyDOS-capable master detected
  * @jiffy_load     : JiffyDOS LOAD operation detected
  * @dolphin_active : DolphinDOS parallel mode active
+ * @fastser_host   : C128 fast serial host detected during ATN
  *
  * NOTE: This was converted from a struct with bitfields to
  *       a single variable with macros because the struct
@@ -55,6 +58,12 @@
 #  define DOLPHIN_ACTIVE 0
 #endif
 
+#ifdef CONFIG_FAST_SERIAL
+#  define FASTSER_HOST   (1<<5)
+#else
+#  define FASTSER_HOST   0
+#endif
+
 typedef struct {
   uint8_t iecflags;
   enum { BUS_IDLE = 0, BUS_ATNACTIVE, BUS_FOUNDATN, BUS_FORME, BUS_NOTFORME, BUS_ATNFINISH, BUS_ATNPROCESS, BUS_CLEANUP, BUS_SLEEP } bus_state;
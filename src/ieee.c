@@ -42,6 +42,7 @@
 #include <stdbool.h>
 
 #include "uart.h"
+#include "bgtask.h"
 #include "buffers.h"
 #include "d64ops.h"
 #include "diskchange.h"
@@ -533,17 +534,17 @@ void ieee488_ListenLoop(uint8_t action, uint8_t sa) {
     BusSignals = ieee488_RxByte(&c);  // Read byte from IEEE bus
 
     if (BusSignals == RX_ATN || BusSignals == RX_IFC)
-      return; // ATN received, abort
-    if (ieee488_CheckIFC()) return;
+      break; // ATN received, abort
+    if (ieee488_CheckIFC()) break;
 
     if (action == LL_OPEN || command_received) {
       RxChar(c);
       continue;
     }
 
-    // Flush buffer if full
-    if (buf->mustflush) {
-      if (buf->refill(buf)) {
+    // Flush buffer if full, keep listening while the write is deferred
+    if (buf->mustflush && !defer_buffer_write(buf)) {
+      if (write_deferred_buffers(buf) || buf->refill(buf)) {
         uart_puts_P(PSTR("refill abort\r\n"));
         ieee488_IgnoreBytes();
         return;
@@ -575,12 +576,111 @@ void ieee488_ListenLoop(uint8_t action, uint8_t sa) {
       }
     }
   }
+
+  // The talker has released the bus, write the blocks held back.
+  // A buffer that was filled by the last byte keeps mustflush set,
+  // so the next LISTEN writes it before storing new data.
+  if (action != LL_OPEN && write_deferred_buffers(buf))
+    uart_puts_P(PSTR("refill abort3\r\n"));
+}
+
+
+/**
+ * ieee488_TxBlock - send the remaining bytes of a buffer
+ * @buf: buffer to be sent
+ *
+ * This is the hot loop of the talker. The next byte is fetched while
+ * the listeners latch the current one and no debug output is done per
+ * byte. The handshake of the last byte is left open with DAV low so
+ * the caller can decide how to continue.
+ * buf->position always points to the byte that is not acknowledged yet,
+ * so a transfer aborted by ATN or IFC continues with that byte.
+ * Returns 0 if all bytes were sent, TX_IFC if IFC was received or the
+ * character of the debug code (T1-T6) if ATN aborted the transfer.
+ */
+#define TX_IFC 1
+
+static uint8_t ieee488_TxBlock(buffer_t *buf) {
+  uint8_t pos  = buf->position;
+  uint8_t last = buf->lastused;
+  uint8_t c    = buf->data[pos];
+  bool    eoi  = buf->sendeoi;
+
+  if (pos > last)                       // Nothing left to send
+    return 0;
+
+  for (;;) {
+    buf->position = pos;
+    ieee488_SetDAV(1);                  // Release DAV and EOI
+    ieee488_SetEOI(1);
+    while (ieee488_NDAC()) {            // Wait for NDAC low
+      if (ieee488_ATN_received) {
+        ieee488_BusIdle();
+        return '1';
+      }
+      if (ieee488_CheckIFC()) return TX_IFC;
+    }
+    while (!ieee488_NRFD()) {           // Wait for NRFD high
+      if (ieee488_ATN_received) return '2';
+      if (ieee488_CheckIFC()) return TX_IFC;
+    }
+
+    if (ieee488_NDAC() || ieee488_ATN_received) {   // NDAC must stay low
+      ieee488_BusIdle();
+      return '3';
+    }
+
+    if (pos == last && eoi)
+      ieee488_SetEOI(0);
+
+    if (ieee488_TE75160 != TE_TALK)
+      ieee488_DataTalk();
+    ieee488_SetData(c);
+    if (ieee488_NDAC() || ieee488_ATN_received)
+      return '4';
+    ieee488_SetDAV(0);                  // Say data valid
+
+#if DEBUG_BUS_DATA
+    uart_puthex(c); uart_putc(' ');
+#endif
+
+    // Preload the next byte while the listeners latch this one
+    if (pos != last)
+      c = buf->data[pos + 1];
+
+    // Wait for NRFD low, NDAC must stay low
+    while (ieee488_NRFD()) {
+      if (ieee488_NDAC() || ieee488_ATN_received) {
+        ieee488_SetDAV(1);
+        ieee488_SetEOI(1);              // Release DAV and EOI
+        ieee488_BusIdle();
+        return '5';
+      }
+      if (ieee488_CheckIFC()) return TX_IFC;
+    }
+
+    while (!ieee488_NDAC()) {           // Wait for NDAC high
+      if (ieee488_ATN_received) {
+        ieee488_SetDAV(1);
+        ieee488_SetEOI(1);              // Release DAV and EOI
+        return '6';
+      }
+      if (ieee488_CheckIFC()) return TX_IFC;
+    }
+
+    // Listeners have received our byte
+    if (pos == last)
+      break;
+    pos++;
+  }
+
+  buf->position = pos + 1;
+  return 0;
 }
 
 
 void ieee488_TalkLoop(uint8_t sa) {
-  int  c;
-  bool LastByte;
+  uint8_t res;
   buffer_t *buf;
 
   // This function returns immediately on ATN low.
@@ -597,79 +697,17 @@ void ieee488_TalkLoop(uint8_t sa) {
   ieee488_CtrlPortsTalk();              // Set hardware to TALK mode
 
   while (buf->read) {
-    do {
-      if (ieee488_CheckIFC()) return;   // IFC received, abort
-      ieee488_SetDAV(1);                // Release DAV and EOI
-      ieee488_SetEOI(1);
-      while (ieee488_NDAC()) {          // Wait for NDAC low
-        if (ieee488_ATN_received) {
-          uart_puts_P(PSTR("T1\r\n"));
-          ieee488_BusIdle();
-          return;
-        }
-        if (ieee488_CheckIFC()) return;
-      }
-      while (!ieee488_NRFD()) {         // Wait for NRFD high
-        if (ieee488_ATN_received) {
-          uart_puts_P(PSTR("T2\r\n"));
-          return;
-        }
-        if (ieee488_CheckIFC()) return;
+    res = ieee488_TxBlock(buf);
+    if (res) {
+      if (res != TX_IFC) {
+        uart_putc('T'); uart_putc(res); uart_puts_P(PSTR("\r\n"));
       }
-
-      // Fetch preloaded byte within less than 64 ms
-      LastByte = (buf->position == buf->lastused);
-      c = buf->data[buf->position];
-
-      if (ieee488_NDAC() || ieee488_ATN_received) {   // NDAC must stay low
-        uart_puts_P(PSTR("T3\r\n"));
-        ieee488_BusIdle();
-        return;
-      }
-
-      ieee488_SetEOI(LastByte && buf->sendeoi ? 0 : 1);
-
-      if (ieee488_TE75160 != TE_TALK)
-        ieee488_DataTalk();
-      ieee488_SetData(c);
-      if (ieee488_NDAC() || ieee488_ATN_received) {
-        uart_puts_P(PSTR("T4\r\n"));
-        return;
-      }
-      ieee488_SetDAV(0);                // Say data valid
-
-      // Wait for NRFD low, NDAC must stay low
-      while (ieee488_NRFD()) {
-        if (ieee488_NDAC() || ieee488_ATN_received) {
-          ieee488_SetDAV(1);
-          ieee488_SetEOI(1);            // Release DAV and EOI
-          uart_puts_P(PSTR("T5\r\n"));
-          ieee488_BusIdle();
-          return;
-        }
-        if (ieee488_CheckIFC()) return;
-      }
-
-      while (!ieee488_NDAC()) {         // Wait for NDAC high
-        if (ieee488_ATN_received) {
-          ieee488_SetDAV(1);
-          ieee488_SetEOI(1);            // Release DAV and EOI
-          uart_puts_P(PSTR("T6\r\n"));
-          return;
-        }
-        if (ieee488_CheckIFC()) return;
-      }
-
-      // Listeners have received our byte
-
-#if DEBUG_BUS_DATA
-      uart_puthex(c); uart_putc(' ');
-#endif
-
-    } while (buf->position++ < buf->lastused);
+      return;
+    }
 
     // PET/CBM-II wait here without timeout until DAV=1
-    // Perfect for flushing buffers without hurry
+    // Perfect for flushing buffers without hurry, releasing DAV
+    // first would start the 64 ms timeout of the listener
 
     uart_puts_P(PSTR("T7\r\n"));
 
@@ -881,6 +919,8 @@ void ieee_mainloop(void) {
     handle_card_changes();
     handle_lcd();
     if (handle_buttons()) break; // switch to IEC bus?
+    if (!ieee488_ATN_received)
+      bgtask_run();                 // one slice, ATN is checked in between
   }
 }
 
@@ -573,9 +573,15 @@ static inline __attribute__((always_inline)) void set_clock_irq(uint8_t state) {
 }
 #define HAVE_CLOCK_IRQ
 
+/* SRQ is a timer-controlled output, so the fast serial protocol is possible */
+#define HAVE_FAST_SERIAL
+
 #undef COND_INV
 
 #ifdef HAVE_PARALLEL
+/* block transfers with register-level loops in llfl-parallel.c */
+#  define HAVE_PARALLEL_BLOCK
+
 static inline void parallel_init(void) {
   /* set HSK_OUT to output, open drain, weak-high (pullup is default-on) */
   PARALLEL_HGPIO->FIOPIN |= BV(PARALLEL_HSK_OUT_BIT);
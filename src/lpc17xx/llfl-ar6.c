@@ -47,47 +47,48 @@ static const generic_2bit_t ar6_1581p_get_def = {
   .eorvalue  = 0xff
 };
 
-void ar6_1581_send_byte(uint8_t byte) {
-  llfl_setup();
-  disable_interrupts();
-
+static const llfl_step_t ar6_1581_send_steps[] = {
   /* wait for handshake */
-  set_clock(1);
-  llfl_wait_data(1, NO_ATNABORT);
+  { LLFL_SET,        LLFL_CLOCK_HIGH,                  0 },
+  { LLFL_WAIT_DATA,  LLFL_HIGH,                        0 },
 
   /* transmit data */
-  llfl_generic_load_2bit(&ar6_1581_send_def, byte);
+  { LLFL_SEND,       0,                                0 },
 
   /* exit with clock low, data high */
-  llfl_set_clock_at(375, 0, NO_WAIT);
-  llfl_set_data_at( 375, 1, WAIT);
+  { LLFL_SET_AT,     LLFL_CLOCK_LOW | LLFL_DATA_HIGH, 375 },
 
   /* short delay to make sure bus has settled */
-  delay_us(10);
-
-  enable_interrupts();
-  llfl_teardown();
-}
-
-uint8_t ar6_1581p_get_byte(void) {
-  uint8_t result;
-
-  llfl_setup();
-  disable_interrupts();
-
-  set_clock(1);
+  { LLFL_DELAY,      0,                               10 },
+  { LLFL_END,        0,                                0 }
+};
 
+static const llfl_step_t ar6_1581p_get_steps[] = {
   /* wait for handshake */
-  while (IEC_DATA) ;
-  llfl_wait_data(1, NO_ATNABORT);
+  { LLFL_SET,        LLFL_CLOCK_HIGH,                  0 },
+  { LLFL_POLL_DATA,  LLFL_LOW,                         0 },
+  { LLFL_WAIT_DATA,  LLFL_HIGH,                        0 },
 
   /* receive data */
-  result = llfl_generic_save_2bit(&ar6_1581p_get_def);
+  { LLFL_RECEIVE,    0,                                0 },
 
   /* exit with clock low */
-  llfl_set_clock_at(530, 0, WAIT);
+  { LLFL_SET_AT,     LLFL_CLOCK_LOW,                 530 },
+  { LLFL_END,        0,                                0 }
+};
+
+static const llfl_protocol_t ar6_1581_send = {
+  &ar6_1581_send_def, ar6_1581_send_steps, LLFL_NOIRQ
+};
+
+static const llfl_protocol_t ar6_1581p_get = {
+  &ar6_1581p_get_def, ar6_1581p_get_steps, LLFL_NOIRQ
+};
 
-  enable_interrupts();
-  llfl_teardown();
-  return result;
+void ar6_1581_send_byte(uint8_t byte) {
+  llfl_run(&ar6_1581_send, byte);
+}
+
+uint8_t ar6_1581p_get_byte(void) {
+  return llfl_run(&ar6_1581p_get, 0);
 }
@@ -23,12 +23,15 @@
 
 */
 
+#include <stdbool.h>
 #include "config.h"
 #include <arm/NXP/LPC17xx/LPC17xx.h>
 #include <arm/bits.h>
 #include "fastloader.h"
 #include "iec-bus.h"
 #include "llfl-common.h"
+#include "system.h"
+#include "timer.h"
 
 #ifdef IEC_OUTPUTS_INVERTED
 #  define EMR_LOW  2
@@ -183,6 +186,35 @@ void llfl_wait_data(unsigned int state, llfl_atnabort_t atnabort) {
   IEC_TIMER_CLOCK->CCR = 0b100100;
 }
 
+/* llfl_wait_srq - see llfl_wait_atn, aborts on ATN low if atnabort is true */
+void llfl_wait_srq(unsigned int state, llfl_atnabort_t atnabort) {
+  /* set up capture */
+  BITBAND(IEC_TIMER_SRQ->CCR, 3*IEC_CAPTURE_SRQ + IEC_IN_COND_INV(!state)) = 1;
+
+  /* clear interrupt flag */
+  IEC_TIMER_SRQ->IR = BV(4 + IEC_CAPTURE_SRQ);
+
+  /* wait until interrupt flag is set */
+  while (!BITBAND(IEC_TIMER_SRQ->IR, 4+IEC_CAPTURE_SRQ))
+    if (atnabort && !IEC_ATN)
+      break;
+
+  if (atnabort && !IEC_ATN) {
+    /* read current time */
+    llfl_reference_time = IEC_TIMER_SRQ->TC;
+  } else {
+    /* read event time */
+    if (IEC_CAPTURE_SRQ == 0) {
+      llfl_reference_time = IEC_TIMER_SRQ->CR0;
+    } else {
+      llfl_reference_time = IEC_TIMER_SRQ->CR1;
+    }
+  }
+
+  /* reset capture mode */
+  IEC_TIMER_SRQ->CCR = 0b100100;
+}
+
 /**
  * llfl_set_clock_at - sets clock line at a specified time offset
  * @time : change time in 100ns after llfl_reference_time
@@ -340,3 +372,101 @@ uint8_t llfl_generic_save_2bit(const generic_2bit_t *def) {
 
   return result ^ def->eorvalue;
 }
+
+/* busy-wait for a clock or data state, returns true if aborted by ATN */
+static bool poll_line(bool clock, uint8_t arg) {
+  while (!(clock ? IEC_CLOCK : IEC_DATA) != !(arg & LLFL_HIGH))
+    if ((arg & LLFL_ATNABORT) && !IEC_ATN)
+      return true;
+
+  return (arg & LLFL_ATNABORT) && !IEC_ATN;
+}
+
+/**
+ * llfl_run - run a table-driven fastloader protocol
+ * @proto: pointer to the protocol definition
+ * @byte : data byte for LLFL_SEND
+ *
+ * This function interprets the steps of a fastloader protocol until
+ * LLFL_END is reached, with the timers set up and optionally with
+ * interrupts disabled, either from the start or from an LLFL_NOIRQ_ON
+ * step on. Returns the byte received by the last
+ * LLFL_RECEIVE step (0 if there was none), or'ed with LLFL_ABORTED
+ * if a wait with LLFL_ATNABORT was ended by ATN.
+ */
+uint16_t llfl_run(const llfl_protocol_t *proto, uint8_t byte) {
+  const llfl_step_t *step;
+  uint16_t result = 0;
+  bool aborted = false;
+  bool noirq   = proto->flags & LLFL_NOIRQ;
+
+  llfl_setup();
+  if (noirq)
+    disable_interrupts();
+
+  for (step = proto->steps; step->op != LLFL_END && !aborted; step++) {
+    uint8_t arg = step->arg;
+
+    switch (step->op) {
+    case LLFL_SET:
+      if (arg & LLFL_CLOCK)
+        set_clock(arg & LLFL_CLOCK_STATE);
+      if (arg & LLFL_DATA)
+        set_data(arg & LLFL_DATA_STATE);
+      break;
+
+    case LLFL_SET_AT:
+      if (arg & LLFL_CLOCK)
+        llfl_set_clock_at(step->time, arg & LLFL_CLOCK_STATE,
+                          (arg & LLFL_DATA) ? NO_WAIT : WAIT);
+      if (arg & LLFL_DATA)
+        llfl_set_data_at(step->time, arg & LLFL_DATA_STATE, WAIT);
+      break;
+
+    case LLFL_WAIT_CLOCK:
+      llfl_wait_clock(arg & LLFL_HIGH, (arg & LLFL_ATNABORT) ? ATNABORT : NO_ATNABORT);
+      aborted = (arg & LLFL_ATNABORT) && !IEC_ATN;
+      break;
+
+    case LLFL_WAIT_DATA:
+      llfl_wait_data(arg & LLFL_HIGH, (arg & LLFL_ATNABORT) ? ATNABORT : NO_ATNABORT);
+      aborted = (arg & LLFL_ATNABORT) && !IEC_ATN;
+      break;
+
+    case LLFL_POLL_CLOCK:
+      aborted = poll_line(true, arg);
+      break;
+
+    case LLFL_POLL_DATA:
+      aborted = poll_line(false, arg);
+      break;
+
+    case LLFL_SEND:
+      llfl_generic_load_2bit(proto->bits, byte);
+      break;
+
+    case LLFL_RECEIVE:
+      result = llfl_generic_save_2bit(proto->bits);
+      break;
+
+    case LLFL_DELAY:
+      delay_us(step->time);
+      break;
+
+    case LLFL_NOIRQ_ON:
+      if (!noirq)
+        disable_interrupts();
+      noirq = true;
+      break;
+    }
+  }
+
+  if (noirq)
+    enable_interrupts();
+  llfl_teardown();
+
+  if (aborted)
+    result |= LLFL_ABORTED;
+
+  return result;
+}
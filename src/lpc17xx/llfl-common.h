@@ -38,6 +38,55 @@ typedef struct {
   uint8_t  eorvalue;
 } generic_2bit_t;
 
+/* operations of a table-driven fastloader protocol */
+typedef enum {
+  LLFL_END,        /* end of protocol                                   */
+  LLFL_SET,        /* set lines immediately                             */
+  LLFL_SET_AT,     /* set lines at time, waits until the change is done */
+  LLFL_WAIT_CLOCK, /* wait for clock state, sets the reference time     */
+  LLFL_WAIT_DATA,  /* wait for data state, sets the reference time      */
+  LLFL_POLL_CLOCK, /* busy-wait for clock state, no reference time      */
+  LLFL_POLL_DATA,  /* busy-wait for data state, no reference time       */
+  LLFL_SEND,       /* transmit the byte using the 2-bit definition      */
+  LLFL_RECEIVE,    /* receive a byte using the 2-bit definition         */
+  LLFL_DELAY,      /* delay for time microseconds                       */
+  LLFL_NOIRQ_ON    /* disable interrupts for the rest of the protocol   */
+} llfl_op_t;
+
+/* line arguments for LLFL_SET and LLFL_SET_AT */
+#define LLFL_CLOCK       0x01  /* clock line is changed */
+#define LLFL_CLOCK_STATE 0x02
+#define LLFL_DATA        0x04  /* data line is changed  */
+#define LLFL_DATA_STATE  0x08
+
+#define LLFL_CLOCK_LOW   LLFL_CLOCK
+#define LLFL_CLOCK_HIGH  (LLFL_CLOCK | LLFL_CLOCK_STATE)
+#define LLFL_DATA_LOW    LLFL_DATA
+#define LLFL_DATA_HIGH   (LLFL_DATA | LLFL_DATA_STATE)
+
+/* state arguments for the wait and poll operations */
+#define LLFL_LOW         0x00
+#define LLFL_HIGH        0x01
+#define LLFL_ATNABORT    0x02
+
+/* protocol flags */
+#define LLFL_NOIRQ       0x01  /* run with interrupts disabled */
+
+/* llfl_run result flag, set if the protocol was aborted by ATN */
+#define LLFL_ABORTED     0x100
+
+typedef struct {
+  uint8_t  op;
+  uint8_t  arg;
+  uint16_t time;  /* 100ns units after the reference time, us for LLFL_DELAY */
+} llfl_step_t;
+
+typedef struct {
+  const generic_2bit_t *bits;
+  const llfl_step_t    *steps;
+  uint8_t               flags;
+} llfl_protocol_t;
+
 extern uint32_t llfl_reference_time;
 
 void llfl_setup(void);
@@ -45,6 +94,7 @@ void llfl_teardown(void);
 void llfl_wait_atn(unsigned int state);
 void llfl_wait_clock(unsigned int state, llfl_atnabort_t atnabort);
 void llfl_wait_data(unsigned int state, llfl_atnabort_t atnabort);
+void llfl_wait_srq(unsigned int state, llfl_atnabort_t atnabort);
 void llfl_set_clock_at(uint32_t time, unsigned int state, llfl_wait_t wait);
 void llfl_set_data_at(uint32_t time, unsigned int state, llfl_wait_t wait);
 void llfl_set_srq_at(uint32_t time, unsigned int state, llfl_wait_t wait);
@@ -52,5 +102,6 @@ uint32_t llfl_read_bus_at(uint32_t time);
 uint32_t llfl_now(void);
 void llfl_generic_load_2bit(const generic_2bit_t *def, uint8_t byte);
 uint8_t llfl_generic_save_2bit(const generic_2bit_t *def);
+uint16_t llfl_run(const llfl_protocol_t *proto, uint8_t byte);
 
 #endif
@@ -0,0 +1,101 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   llfl-fastser.c: Low level handling of the 1571/1581 fast serial protocol
+
+   Fast serial transfers a byte MSB first over the DATA line, clocked
+   by SRQ. The data bit must be valid on the rising edge of SRQ, which
+   is where the 6526 shift register of the receiver samples it.
+
+*/
+
+#include "config.h"
+#include <arm/NXP/LPC17xx/LPC17xx.h>
+#include <arm/bits.h>
+#include "iec-bus.h"
+#include "llfl-common.h"
+#include "fastloader-ll.h"
+
+#ifdef CONFIG_FAST_SERIAL
+
+/* bit cell length and SRQ low time in 100ns units (1571: 4us per bit) */
+#define FASTSER_BIT_TIME  40
+#define FASTSER_SRQ_LOW   20
+
+/**
+ * fastser_send_byte - send a byte using fast serial
+ * @byte: data byte
+ *
+ * This function shifts out one byte on the DATA line, clocked by SRQ.
+ * SRQ is released at the end, DATA is left at the level of the last
+ * bit so a byte of 0 can be sent while DATA is held low.
+ */
+void fastser_send_byte(uint8_t byte) {
+  unsigned int i;
+  uint32_t ticks = 0;
+
+  llfl_setup();
+  llfl_reference_time = llfl_now() + 10;
+
+  for (i = 0; i < 8; i++) {
+    llfl_set_srq_at (ticks, 0, NO_WAIT);
+    llfl_set_data_at(ticks, byte & 0x80, WAIT);
+    llfl_set_srq_at (ticks + FASTSER_SRQ_LOW, 1, WAIT);
+    ticks += FASTSER_BIT_TIME;
+    byte <<= 1;
+  }
+
+  /* let the receiver sample the final bit before anything changes */
+  while (llfl_now() < llfl_reference_time + ticks) ;
+
+  llfl_teardown();
+}
+
+/**
+ * fastser_get_byte - receive a byte using fast serial
+ *
+ * This function receives one byte that is clocked in by the host on
+ * SRQ. Returns the byte or -1 if ATN was asserted before the transfer
+ * was complete.
+ */
+int16_t fastser_get_byte(void) {
+  unsigned int i;
+  uint8_t byte = 0;
+
+  llfl_setup();
+
+  for (i = 0; i < 8; i++) {
+    llfl_wait_srq(1, ATNABORT);
+    if (!IEC_ATN) {
+      llfl_teardown();
+      return -1;
+    }
+
+    byte = (byte << 1) | !!(llfl_read_bus_at(5) & IEC_BIT_DATA);
+  }
+
+  llfl_teardown();
+  return byte;
+}
+
+#endif
@@ -39,25 +39,26 @@ static const generic_2bit_t n0sdos_send_def = {
   .eorvalue  = 0xff
 };
 
-void n0sdos_send_byte(uint8_t byte) {
-  llfl_setup();
-  disable_interrupts();
-
+static const llfl_step_t n0sdos_send_steps[] = {
   /* wait for handshake */
-  set_clock(1);
-  set_data(1);
-  llfl_wait_clock(1, NO_ATNABORT);
+  { LLFL_SET,        LLFL_CLOCK_HIGH | LLFL_DATA_HIGH,  0 },
+  { LLFL_WAIT_CLOCK, LLFL_HIGH,                         0 },
 
   /* transmit data */
-  llfl_generic_load_2bit(&n0sdos_send_def, byte);
+  { LLFL_SEND,       0,                                 0 },
 
   /* exit with clock high, data low */
-  llfl_set_clock_at(380, 1, NO_WAIT);
-  llfl_set_data_at( 380, 0, WAIT);
+  { LLFL_SET_AT,     LLFL_CLOCK_HIGH | LLFL_DATA_LOW, 380 },
 
   /* C64 sets clock low at 42.5us, make sure we exit later than that */
-  delay_us(6);
+  { LLFL_DELAY,      0,                                 6 },
+  { LLFL_END,        0,                                 0 }
+};
 
-  enable_interrupts();
-  llfl_teardown();
+static const llfl_protocol_t n0sdos_send = {
+  &n0sdos_send_def, n0sdos_send_steps, LLFL_NOIRQ
+};
+
+void n0sdos_send_byte(uint8_t byte) {
+  llfl_run(&n0sdos_send, byte);
 }
@@ -29,16 +29,31 @@
 #include "iec-bus.h"
 #include "timer.h"
 #include "fastloader-ll.h"
+#include "fastloader.h"
+
+#if (PARALLEL_PSTARTBIT & 7) == 0
+/* byte-wide access to the data lines avoids a read-modify-write cycle */
+#  define PARALLEL_PBYTE \
+  (((volatile uint8_t *)&PARALLEL_PGPIO->FIOPIN)[PARALLEL_PSTARTBIT / 8])
+#endif
 
 
 uint8_t parallel_read(void) {
   return (PARALLEL_PGPIO->FIOPIN >> PARALLEL_PSTARTBIT) & 0xff;
 }
 
-void parallel_write(uint8_t value) {
+static inline void parallel_put(uint8_t value) {
+#ifdef PARALLEL_PBYTE
+  PARALLEL_PBYTE = value;
+#else
   PARALLEL_PGPIO->FIOPIN =
     (PARALLEL_PGPIO->FIOPIN & ~(0xff << PARALLEL_PSTARTBIT)) |
     (value << PARALLEL_PSTARTBIT);
+#endif
+}
+
+void parallel_write(uint8_t value) {
+  parallel_put(value);
   delay_us(1);
 }
 
@@ -54,3 +69,63 @@ void parallel_send_handshake(void) {
   delay_us(2);
   PARALLEL_HGPIO->FIOSET = BV(PARALLEL_HSK_OUT_BIT);
 }
+
+#ifdef HAVE_PARALLEL_BLOCK
+/**
+ * parallel_send_block - send bytes with hardware handshake
+ * @data : pointer to the data
+ * @count: number of bytes, must not be 0
+ *
+ * This function sends count bytes over the parallel port, each
+ * followed by a handshake pulse. It waits for the acknowledge of every
+ * byte except the last one, which stays on the port while the caller
+ * prepares more data; use parallel_wait_ack to wait for it.
+ */
+void parallel_send_block(const uint8_t *data, uint16_t count) {
+  while (1) {
+    parallel_put(*data++);
+    delay_us(1);
+    parallel_clear_rxflag();
+    PARALLEL_HGPIO->FIOCLR = BV(PARALLEL_HSK_OUT_BIT);
+    delay_us(2);
+    PARALLEL_HGPIO->FIOSET = BV(PARALLEL_HSK_OUT_BIT);
+
+    if (--count == 0)
+      return;
+
+    while (!parallel_rxflag) ;
+  }
+}
+
+/**
+ * parallel_receive_block - receive bytes with hardware handshake
+ * @data : pointer to the buffer
+ * @count: maximum number of bytes, must not be 0
+ * @eoi  : set to 1 if the last byte was marked with CLOCK high
+ *
+ * This function receives bytes from the parallel port until count
+ * bytes were read or the sender marked a byte as the last one.
+ * Every byte is acknowledged immediately, so the sender can prepare
+ * the next byte while the caller processes the data.
+ * Returns the number of bytes received.
+ */
+uint16_t parallel_receive_block(uint8_t *data, uint16_t count, uint8_t *eoi) {
+  uint16_t received = 0;
+  uint8_t last;
+
+  do {
+    while (!parallel_rxflag) ;
+
+    data[received++] = (PARALLEL_PGPIO->FIOPIN >> PARALLEL_PSTARTBIT) & 0xff;
+    last = !!IEC_CLOCK;
+
+    parallel_clear_rxflag();
+    PARALLEL_HGPIO->FIOCLR = BV(PARALLEL_HSK_OUT_BIT);
+    delay_us(2);
+    PARALLEL_HGPIO->FIOSET = BV(PARALLEL_HSK_OUT_BIT);
+  } while (!last && received < count);
+
+  *eoi = last;
+  return received;
+}
+#endif
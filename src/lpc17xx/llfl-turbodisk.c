@@ -38,23 +38,27 @@ static const generic_2bit_t turbodisk_byte_def = {
   .eorvalue  = 0
 };
 
-void turbodisk_byte(uint8_t value) {
-  llfl_setup();
-
+static const llfl_step_t turbodisk_byte_steps[] = {
   /* wait for handshake */
-  while (IEC_DATA) ;
-  set_clock(1);
-  llfl_wait_data(1, NO_ATNABORT);
+  { LLFL_POLL_DATA,  LLFL_LOW,                          0 },
+  { LLFL_SET,        LLFL_CLOCK_HIGH,                   0 },
+  { LLFL_WAIT_DATA,  LLFL_HIGH,                         0 },
 
   /* transmit data */
-  llfl_generic_load_2bit(&turbodisk_byte_def, value);
+  { LLFL_SEND,       0,                                 0 },
 
   /* exit with clock low, data high */
-  llfl_set_clock_at(1470, 0, NO_WAIT);
-  llfl_set_data_at( 1470, 1, WAIT);
-  delay_us(5);
+  { LLFL_SET_AT,     LLFL_CLOCK_LOW | LLFL_DATA_HIGH, 1470 },
+  { LLFL_DELAY,      0,                                 5 },
+  { LLFL_END,        0,                                 0 }
+};
 
-  llfl_teardown();
+static const llfl_protocol_t turbodisk_byte_proto = {
+  &turbodisk_byte_def, turbodisk_byte_steps, 0
+};
+
+void turbodisk_byte(uint8_t value) {
+  llfl_run(&turbodisk_byte_proto, value);
 }
 
 void turbodisk_buffer(uint8_t *data, uint8_t length) {
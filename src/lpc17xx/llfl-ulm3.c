@@ -47,57 +47,58 @@ static const generic_2bit_t uload3_send_def = {
   .eorvalue  = 0
 };
 
-int16_t uload3_get_byte(void) {
-  uint8_t result;
-
-  /* initial handshake */
-  set_clock(0);
-  while (IEC_DATA && IEC_ATN) ;
-  if (!IEC_ATN)
-    return -1;
-
-  llfl_setup();
-  disable_interrupts();
+static const llfl_step_t uload3_get_steps[] = {
+  /* initial handshake, the host may take a long time to answer */
+  { LLFL_SET,        LLFL_CLOCK_LOW,                    0 },
+  { LLFL_POLL_DATA,  LLFL_LOW | LLFL_ATNABORT,          0 },
+  { LLFL_NOIRQ_ON,   0,                                 0 },
 
   /* wait for start signal */
-  set_clock(1);
-  llfl_wait_data(1, NO_ATNABORT);
+  { LLFL_SET,        LLFL_CLOCK_HIGH,                   0 },
+  { LLFL_WAIT_DATA,  LLFL_HIGH,                         0 },
 
   /* receive data */
-  result = llfl_generic_save_2bit(&uload3_get_def);
+  { LLFL_RECEIVE,    0,                                 0 },
 
   /* wait until the C64 releases the bus */
-  delay_us(20);
-
-  enable_interrupts();
-  llfl_teardown();
-  return result;
-}
-
-void uload3_send_byte(uint8_t byte) {
-  llfl_setup();
-  disable_interrupts();
+  { LLFL_DELAY,      0,                                20 },
+  { LLFL_END,        0,                                 0 }
+};
 
+static const llfl_step_t uload3_send_steps[] = {
   /* initial handshake */
-  set_data(0);
-  while (IEC_CLOCK && IEC_ATN) ;
-  if (!IEC_ATN)
-    goto exit;
+  { LLFL_SET,        LLFL_DATA_LOW,                     0 },
+  { LLFL_POLL_CLOCK, LLFL_LOW | LLFL_ATNABORT,          0 },
 
   /* wait for start signal */
-  set_data(1);
-  llfl_wait_clock(1, ATNABORT);
-  if (!IEC_ATN)
-    goto exit;
+  { LLFL_SET,        LLFL_DATA_HIGH,                    0 },
+  { LLFL_WAIT_CLOCK, LLFL_HIGH | LLFL_ATNABORT,         0 },
 
   /* transmit data */
-  llfl_generic_load_2bit(&uload3_send_def, byte);
+  { LLFL_SEND,       0,                                 0 },
 
   /* exit with clock+data high */
-  llfl_set_clock_at(480, 1, NO_WAIT);
-  llfl_set_data_at (480, 1, WAIT);
+  { LLFL_SET_AT,     LLFL_CLOCK_HIGH | LLFL_DATA_HIGH, 480 },
+  { LLFL_END,        0,                                 0 }
+};
 
- exit:
-  enable_interrupts();
-  llfl_teardown();
+static const llfl_protocol_t uload3_get = {
+  &uload3_get_def, uload3_get_steps, 0
+};
+
+static const llfl_protocol_t uload3_send = {
+  &uload3_send_def, uload3_send_steps, LLFL_NOIRQ
+};
+
+int16_t uload3_get_byte(void) {
+  uint16_t result = llfl_run(&uload3_get, 0);
+
+  if (result & LLFL_ABORTED)
+    return -1;
+
+  return result;
+}
+
+void uload3_send_byte(uint8_t byte) {
+  llfl_run(&uload3_send, byte);
 }
@@ -48,6 +48,7 @@
 #include "parser.h"     // current_part
 #include "wrapops.h"
 #include "fatops.h"     // pet2ascn()
+#include "dirindex.h"
 #include "doscmd.h"
 
 
@@ -58,7 +59,7 @@ uint8_t menu_system_enabled = true;
 #endif
 
 #define MAX_LASTPOS 16
-#define ENTRIES_PER_BLOCK (256 / sizeof(entry_t))
+#define WINDOW_SIZE (CONFIG_DIR_BUFFERS * 256 / sizeof(entry_t))
 #define E_DIR   1
 #define E_IMAGE 2
 
@@ -66,13 +67,24 @@ typedef struct {
   uint8_t  flags;
   uint8_t  filename[16];
   uint16_t filesize;
+  uint16_t index;       // position in directory order
 } entry_t;
 
 
 static tick_t lcd_timeout;
 static bool lcd_timer;
 static uint16_t lcd_current_screen;
-static entry_t *ep[CONFIG_DIR_BUFFERS * ENTRIES_PER_BLOCK];
+
+// File browser state: only a window of the sorted directory is kept
+static buffer_t *dir_buf;       // directory handle for scans
+static entry_t  *window;        // sorted slice of the directory
+static uint16_t  win_start;     // sorted position of window[0]
+static uint8_t   win_count;     // number of valid entries in window
+static uint16_t  entries;       // number of entries found by the last scan
+static uint16_t  scan_index;
+static bool      sort_entries;  // FAT dirs are sorted, images keep their order
+static bool      indexed;       // sorted order is read from the directory index
+static path_t    browse_path;
 
 
 static inline uint8_t min(uint8_t a, uint8_t b) {
@@ -387,6 +399,7 @@ void menu_set_clock(void) {
         case 1:         // Set time
           t.tm_wday = day_of_week(t.tm_year, t.tm_mon + 1, t.tm_mday);
           set_rtc(&t);
+          rtc_cache_invalidate();
 
         // fall through
 
@@ -400,14 +413,14 @@ void menu_set_clock(void) {
   }
 }
 
-void lcd_print_dir_entry(uint16_t i) {
+static void lcd_print_dir_entry(entry_t *e) {
   char filename[16 + 1];
 
-  if      (ep[i]->flags & E_DIR)   lcd_puts_P(PSTR("DIR "));
-  else if (ep[i]->flags & E_IMAGE) lcd_puts_P(PSTR("IMG "));
-  else lcd_printf("%3u ", ep[i]->filesize);
+  if      (e->flags & E_DIR)   lcd_puts_P(PSTR("DIR "));
+  else if (e->flags & E_IMAGE) lcd_puts_P(PSTR("IMG "));
+  else lcd_printf("%3u ", e->filesize);
   memset (filename, 0, sizeof(filename));
-  ustrncpy(filename, ep[i]->filename,
+  ustrncpy(filename, e->filename,
            (LCD_COLS - 4) > 16 ? 16 : LCD_COLS - 4);
   pet2asc((uint8_t *) filename);
   lcd_puts(filename);
@@ -418,25 +431,233 @@ void clear_command_buffer(void) {
   command_length = 0;
 }
 
-int compare(const void *p1, const void *p2) {
-  const entry_t *const *a = p1;
-  const entry_t *const *b = p2;
+static int8_t compare_entries(const entry_t *a, const entry_t *b) {
+  if (sort_entries) {
+    // 1st: directories alphabetically
+    // 2nd: image files alphabetically
+    // 3rd: file names alphabetically
+
+    bool a_is_dir = (a->flags & E_DIR);
+    bool b_is_dir = (b->flags & E_DIR);
+    if (a_is_dir && !b_is_dir) return -1;
+    else if (!a_is_dir && b_is_dir) return 1;
+
+    bool a_is_img = (a->flags & E_IMAGE);
+    bool b_is_img = (b->flags & E_IMAGE);
+    if (a_is_img && !b_is_img) return -1;
+    else if (!a_is_img && b_is_img) return 1;
+
+    int res = memcmp(a->filename, b->filename, sizeof(a->filename));
+    if (res < 0) return -1;
+    else if (res > 0) return 1;
+  }
+
+  // Directory order, also makes entries with identical names unique
+  if (a->index < b->index) return -1;
+  else if (a->index > b->index) return 1;
+  return 0;
+}
+
+static bool scan_start(void) {
+  scan_index = 0;
+  return opendir(&dir_buf->pvt.dir.dh, &browse_path) == 0;
+}
 
-  // 1st: directories alphabetically
-  // 2nd: image files alphabetically
-  // 3rd: file names alphabetically
+static void make_entry(entry_t *e, cbmdirent_t *dent, uint16_t index) {
+  e->flags = 0;
+  if (dent->opstype == OPSTYPE_FAT &&
+      check_imageext(dent->pvt.fat.realname) != IMG_UNKNOWN)
+    e->flags |= E_IMAGE;
+  if ((dent->typeflags & EXT_TYPE_MASK) == TYPE_DIR)
+    e->flags |= E_DIR;
+  ustrncpy(e->filename, dent->name, sizeof(e->filename));
+  e->filesize = dent->blocksize;
+  e->index    = index;
+}
 
-  bool a_is_dir = ((*a)->flags & E_DIR);
-  bool b_is_dir = ((*b)->flags & E_DIR);
-  if (a_is_dir && !b_is_dir) return -1;
-  else if (!a_is_dir && b_is_dir) return 1;
+static bool scan_next(entry_t *e) {
+  cbmdirent_t dent;
 
-  bool a_is_img = ((*a)->flags & E_IMAGE);
-  bool b_is_img = ((*b)->flags & E_IMAGE);
-  if (a_is_img && !b_is_img) return -1;
-  else if (!a_is_img && b_is_img) return 1;
+  if (next_match(&dir_buf->pvt.dir.dh, NULL, NULL, NULL, 0, &dent))
+    return false;
 
-  return ustrcmp((*a)->filename, (*b)->filename);
+  make_entry(e, &dent, scan_index++);
+  return true;
+}
+
+/**
+ * collect_entries - read a slice of the sorted directory
+ * @dst    : destination array
+ * @max    : maximum number of entries to store, must not be 0
+ * @lower  : exclusive lower bound or NULL
+ * @upper  : exclusive upper bound or NULL
+ * @largest: keep the largest instead of the smallest entries
+ *
+ * This function reads the whole directory once and keeps the @max
+ * smallest (or largest) entries between both bounds in @dst, sorted
+ * in ascending order. It also updates the total number of entries.
+ * Returns the number of entries stored.
+ */
+static uint8_t collect_entries(entry_t *dst, uint8_t max,
+                               const entry_t *lower, const entry_t *upper,
+                               bool largest) {
+  entry_t e;
+  uint8_t count = 0;
+  uint8_t pos;
+
+  if (!scan_start()) {
+    entries = 0;
+    return 0;
+  }
+
+  while (scan_next(&e)) {
+    if ((lower && compare_entries(&e, lower) <= 0) ||
+        (upper && compare_entries(&e, upper) >= 0))
+      continue;
+
+    if (count == max) {
+      if (largest) {
+        if (compare_entries(&e, &dst[0]) <= 0)
+          continue;
+        memmove(dst, dst + 1, (max - 1) * sizeof(entry_t));
+      } else {
+        if (compare_entries(&e, &dst[max - 1]) >= 0)
+          continue;
+      }
+      count--;
+    }
+
+    // Insertion sort, the slice is small
+    pos = count++;
+    while (pos > 0 && compare_entries(&e, &dst[pos - 1]) < 0) {
+      dst[pos] = dst[pos - 1];
+      pos--;
+    }
+    dst[pos] = e;
+  }
+
+  entries = scan_index;
+  return count;
+}
+
+static void fetch_head(void) {
+  win_start = 0;
+  win_count = collect_entries(window, WINDOW_SIZE, NULL, NULL, false);
+}
+
+static void fetch_tail(void) {
+  win_count = collect_entries(window, WINDOW_SIZE, NULL, NULL, true);
+  win_start = entries - win_count;
+}
+
+/* Move the window forward, keeping one screen of overlap */
+static void page_forward(void) {
+  uint8_t keep = min(LCD_LINES, win_count);
+
+  if (keep == 0) {
+    fetch_head();
+    return;
+  }
+
+  memmove(window, window + win_count - keep, keep * sizeof(entry_t));
+  win_start += win_count - keep;
+  win_count  = keep + collect_entries(window + keep, WINDOW_SIZE - keep,
+                                      &window[keep - 1], NULL, false);
+}
+
+/* Move the window backward, keeping one screen of overlap */
+static void page_backward(void) {
+  uint8_t keep = min(LCD_LINES, win_count);
+  uint8_t n;
+
+  if (keep == 0) {
+    fetch_head();
+    return;
+  }
+
+  memmove(window + WINDOW_SIZE - keep, window, keep * sizeof(entry_t));
+  n = collect_entries(window, WINDOW_SIZE - keep,
+                      NULL, &window[WINDOW_SIZE - keep], true);
+  memmove(window + n, window + WINDOW_SIZE - keep, keep * sizeof(entry_t));
+  win_start = (n > win_start) ? 0 : win_start - n;
+  win_count = n + keep;
+}
+
+/**
+ * fetch_from - restore a window starting at a known entry
+ * @pos  : sorted position of the entry
+ * @index: directory index of the entry
+ *
+ * This function is used when returning to a directory, it avoids
+ * paging through the whole directory to reach the old position.
+ */
+static void fetch_from(uint16_t pos, uint16_t index) {
+  if (pos > 0 && scan_start()) {
+    while (scan_next(&window[0])) {
+      if (window[0].index == index) {
+        win_start = pos;
+        win_count = 1 + collect_entries(window + 1, WINDOW_SIZE - 1,
+                                        &window[0], NULL, false);
+        return;
+      }
+    }
+  }
+  fetch_head();
+}
+
+/**
+ * get_entry - return an entry of the sorted directory
+ * @pos: sorted position of the entry
+ *
+ * This function returns a pointer to the entry at position pos,
+ * moving the window if required. Returns NULL if there is no such
+ * entry. The pointer is valid until the next call.
+ */
+static entry_t *get_entry(uint16_t pos) {
+  uint16_t old_start;
+  uint8_t  old_count;
+
+  if (indexed) {
+    // The index is sorted already, entries are read one at a time
+    cbmdirent_t dent;
+
+    if (pos >= entries)
+      return NULL;
+    if (pos != win_start || win_count == 0) {
+      if (dirindex_read_sorted(&browse_path, pos, &dent))
+        return NULL;
+      make_entry(&window[0], &dent, pos);
+      win_start = pos;
+      win_count = 1;
+    }
+    return &window[0];
+  }
+
+  while (pos < win_start || pos >= win_start + win_count) {
+    if (pos >= entries)
+      return NULL;
+
+    old_start = win_start;
+    old_count = win_count;
+
+    if (pos < win_start) {
+      if (pos < WINDOW_SIZE)
+        fetch_head();
+      else
+        page_backward();
+    } else {
+      if (pos + WINDOW_SIZE >= entries)
+        fetch_tail();
+      else
+        page_forward();
+    }
+
+    // Directory changed behind our back
+    if (win_start == old_start && win_count == old_count)
+      return NULL;
+  }
+
+  return &window[pos - win_start];
 }
 
 
@@ -469,156 +690,90 @@ static void rom_menu_main(uint8_t y) {
 
 
 void menu_browse_files(void) {
-  buffer_t *buf;
-  buffer_t *buf_tbl;
-  buffer_t *buf_cur;
-  buffer_t *first_buf;
-  path_t path;
-  cbmdirent_t dent;
-  uint16_t entries;
-  uint8_t entry_num;
-  bool fat_filesystem;
+  buffer_t *win_buf;
+  entry_t *e;
   uint8_t i;
   uint8_t my;
   uint16_t mp;
+  uint16_t y;
   bool action;
   uint16_t stack_mp[MAX_LASTPOS];
   uint8_t stack_my[MAX_LASTPOS];
+  uint16_t stack_top[MAX_LASTPOS];
   uint8_t pos_stack;
   uint8_t save_active_buffers;
 
   pos_stack = 0;
   memset(stack_mp, 0, sizeof(stack_mp));
   memset(stack_my, 0, sizeof(stack_my));
+  memset(stack_top, 0, sizeof(stack_top));
   save_active_buffers = active_buffers;
 
-start:
-  lcd_clear();
-  lcd_puts_P(PSTR("Reading..."));
-
-  buf = buf_tbl = buf_cur = first_buf = NULL;
-  entries = entry_num = mp = 0;
-  fat_filesystem = false;
-
-  // Allocate one buffer, used to read a single directory entry
-  if ((buf = alloc_system_buffer()) == NULL) return;
-
-  // Allocate buffers with continuous data segments
-  // Stores pointers to directory entries for qsort
-  if ((buf_tbl = alloc_linked_buffers(CONFIG_DIR_BUFFERS)) == NULL) return;
-
-  // Buffers to store the actual diretory entries.
-  // Whilst the directory grows, new buffers get allocated and linked
-  if ((buf_cur = alloc_system_buffer()) == NULL) return;
-  first_buf = buf_cur;
+  // One buffer for the directory handle, the window of sorted entries
+  // uses continuous data segments
+  if ((dir_buf = alloc_system_buffer()) == NULL) return;
+  if ((win_buf = alloc_linked_buffers(CONFIG_DIR_BUFFERS)) == NULL) {
+    free_buffer(dir_buf);
+    return;
+  }
+  window = (entry_t *) win_buf->data;
 
   // Allocating buffers affects the LEDs
   set_busy_led(false); set_dirty_led(true);
 
-  path.part = current_part;
-  path.dir  = partition[path.part].current_dir;
-  uart_trace(&path.dir, 0, sizeof(dir_t));
-  uart_putcrlf();
-  uart_flush();
-  if (opendir(&buf->pvt.dir.dh, &path)) return;
-
-  for (;;) {
-    if (next_match(&buf->pvt.dir.dh,
-                    buf->pvt.dir.matchstr,
-                    buf->pvt.dir.match_start,
-                    buf->pvt.dir.match_end,
-                    buf->pvt.dir.filetype,
-                    &dent) == 0)
-    {
-      uint8_t e_flags = 0;
-      if (dent.opstype == OPSTYPE_FAT) {
-        fat_filesystem = true;
-        if (check_imageext(dent.pvt.fat.realname) != IMG_UNKNOWN)
-          e_flags |= E_IMAGE;
-      }
-      // Current block full?
-      if (entry_num == ENTRIES_PER_BLOCK) {
-        entry_num = 0;
-        buffer_t *old_buf = buf_cur;
-        if ((buf_cur = alloc_system_buffer()) == NULL) {
-          printf("alloc buf_cur failed, %d entries", entries);
-          goto cleanup;
-        }
-        set_busy_led(false); set_dirty_led(true);
-        buf_cur->pvt.buffer.next = NULL;
-        old_buf->pvt.buffer.next = buf_cur;
-      }
-
-      // Store entry
-      ep[entries] = (entry_t *) (buf_cur->data + entry_num * sizeof(entry_t));
-      ustrncpy(ep[entries]->filename, dent.name, 16);
-      ep[entries]->filesize = dent.blocksize;
-      if ((dent.typeflags & EXT_TYPE_MASK) == TYPE_DIR)
-        e_flags |= E_DIR;
-      ep[entries]->flags = e_flags;
-      entries++;
-      entry_num++;
-    } else {
-      // No more directory entries to read
-      break;
-    }
-  }
-  printf("%d entries\r\n", entries);
-
-  if (fat_filesystem)
-    qsort(ep, entries, sizeof(entry_t*), compare);
+start:
+  lcd_clear();
+  lcd_puts_P(PSTR("Reading..."));
 
-  for (uint16_t i = 0; i < entries; i++) {
-    printf("%3u: ", i);
-    if (ep[i]->flags & E_DIR)
-      uart_puts_P(PSTR(" DIR "));
-    else if (ep[i]->flags & E_IMAGE)
-      uart_puts_P(PSTR(" IMG "));
-    else
-      printf("%4u ", ep[i]->filesize);
-    uint8_t filename[16 + 1];
-    ustrncpy(filename, ep[i]->filename, 16);
-    filename[16] = '\0';
-    pet2asc(filename);
-    printf("%s\r\n", filename);
-    uart_flush();
-  }
-  uart_putcrlf();
+  browse_path.part = current_part;
+  browse_path.dir  = partition[browse_path.part].current_dir;
+  sort_entries = (partition[browse_path.part].fop == &fatops);
+  win_start = win_count = entries = 0;
 
 #define DIRNAV_OFFSET   2
 #define NAV_ABORT       0
 #define NAV_PARENT      1
 
+  // Only the first screen is read here, the rest follows on scrolling
   mp = stack_mp[pos_stack];
   my = stack_my[pos_stack];
-  printf("mp set to %d\r\n", mp);
-  if (mp < (LCD_LINES - 1))
-    my = mp;
-  else
-    my = 0;
-  action = false;
-
-  for (i=0; i < MAX_LASTPOS; i++) {
-    if (pos_stack == i) uart_putc('>');
-    printf("%d ", stack_mp[i]);
+  entries = dirindex_sorted(&browse_path);
+  indexed = (entries != DIRINDEX_NONE);
+  if (indexed) {
+    // The index is rebuilt if the directory changed, which usually
+    // changes the number of entries, too
+    if (mp >= entries + DIRNAV_OFFSET)
+      mp = my = 0;
+  } else {
+    if (mp - my > DIRNAV_OFFSET)
+      fetch_from(mp - my - DIRNAV_OFFSET, stack_top[pos_stack]);
+    else
+      fetch_head();
+
+    // Start at the top if the directory has changed
+    if (mp >= entries + DIRNAV_OFFSET ||
+        (mp - my > DIRNAV_OFFSET && win_start != mp - my - DIRNAV_OFFSET)) {
+      mp = my = 0;
+      if (win_start != 0)
+        fetch_head();
+    }
   }
-  uart_putcrlf();
+  action = false;
 
   for (;;) {
     lcd_clear();
     for (i = 0; i < LCD_LINES; i++) {
       lcd_locate(0, i);
-      int8_t y = mp - my + i;
-      if (y < 0) return; // should not happen!
+      y = mp - my + i;
       if (y < DIRNAV_OFFSET) {
         rom_menu_browse(y);
       } else {
-        y -= DIRNAV_OFFSET;
-        if (y >= entries) {
+        e = get_entry(y - DIRNAV_OFFSET);
+        if (e == NULL) {
           lcd_puts_P(PSTR("-- End of dir --"));
           break;
         } else {
-          lcd_print_dir_entry(y);
+          lcd_print_dir_entry(e);
         }
       }
     }
@@ -626,26 +781,19 @@ start:
     lcd_cursor(true);
     for (;;) {
       lcd_locate(0, my);
-      //printf("mp: %u   my: %u\r\n", mp, my);
-      //while (!get_key_state(KEY_ANY));
       if (get_key_autorepeat(KEY_PREV)) {
         if (mp > 0) {
           --mp;
           if (my > 0) --my;
           else {
             my = LCD_LINES - 1;
-            if (mp < LCD_LINES) {
-              while ((mp - my) >= DIRNAV_OFFSET) {
-                --my;
-                // TODO: is this really necessary?
-                uart_puts_P(PSTR("my fixed\r\n"));
-              }
-            }
+            if (my > mp) my = mp;
             break;
           }
         } else {
-          my = LCD_LINES - 2;
           mp = entries + DIRNAV_OFFSET - 1;
+          my = LCD_LINES - 2;
+          if (my > mp) my = mp;
           break;
         }
       }
@@ -670,9 +818,9 @@ start:
     }
     lcd_cursor(false);
     if (!action) continue;
+    action = false;
     if (mp == NAV_ABORT) goto cleanup;
     if (mp == NAV_PARENT) {
-      uart_puts_P(PSTR("CD_\r\n"));
       ustrcpy_P(command_buffer, PSTR("CD_"));
       command_length = 3;
       parse_doscommand();
@@ -680,52 +828,43 @@ start:
       stack_mp[pos_stack] = 0;
       stack_my[pos_stack] = 0;
       if (pos_stack > 0) --pos_stack;
-      printf("pos_stack set to %d\r\n", pos_stack);
       if (current_error != ERROR_OK) goto cleanup;
-      goto reread;
+      goto start;
     }
-    if (ep[mp - DIRNAV_OFFSET]->flags & E_DIR ||
-        ep[mp - DIRNAV_OFFSET]->flags & E_IMAGE)
-    {
+    e = get_entry(mp - DIRNAV_OFFSET);
+    if (e != NULL && (e->flags & E_DIR || e->flags & E_IMAGE)) {
       clear_command_buffer();
       ustrcpy_P(command_buffer, PSTR("CD:"));
-      ustrncpy(command_buffer + 3, ep[mp - DIRNAV_OFFSET]->filename, 16);
+      ustrncpy(command_buffer + 3, e->filename, 16);
       command_length = ustrlen(command_buffer);
-      parse_doscommand();
-      clear_command_buffer();
-      if (current_error != ERROR_OK) goto cleanup;
-      if (pos_stack < MAX_LASTPOS) {
+
+      // Remember the first entry on screen to restore the window later
+      if (pos_stack < MAX_LASTPOS - 1) {
+        if (mp - my > DIRNAV_OFFSET &&
+            (e = get_entry(mp - my - DIRNAV_OFFSET)) != NULL)
+          stack_top[pos_stack] = e->index;
         stack_mp[pos_stack]   = mp;
         stack_my[pos_stack++] = my;
-        printf("pos_stack set to %d\r\n", pos_stack);
       }
-      goto reread;
+
+      parse_doscommand();
+      clear_command_buffer();
+      if (current_error != ERROR_OK) goto cleanup;
+      goto start;
     }
   }
 
-reread:
-  free_buffer(buf);
+cleanup:
+  free_buffer(dir_buf);
 
-  buffer_t *p = buf_tbl;
+  buffer_t *p = win_buf;
   do {
     p->allocated = 0;
     p = p->pvt.buffer.next;
   } while (p != NULL);
 
-  p = first_buf;
-  if (p != NULL) do {
-    p->allocated = 0;
-    p = p->pvt.buffer.next;
-  } while (p != NULL);
-
   set_busy_led(false); set_dirty_led(true);
   active_buffers = save_active_buffers;
-  if (mp == NAV_ABORT) return;
-  goto start;
-
-cleanup:
-  mp = NAV_ABORT;
-  goto reread;
 }
 
 #ifdef HAVE_DUAL_INTERFACE
@@ -0,0 +1,195 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   remount.c: Fast remount of known cards
+
+*/
+#include <string.h>
+#include "config.h"
+#include "diskio.h"
+#include "dirent.h"
+#include "fatops.h"
+#include "ff.h"
+#include "parser.h"
+#include "remount.h"
+
+/*
+  Mounting a new card needs a scan of its partition table (MBR, the
+  chain of extended partitions or a GPT) before the file systems can
+  be mounted. For each card seen since power-on the layout found is
+  remembered, keyed by the card's CID, so reinserting it only needs a
+  single initialisation and one boot sector read per partition.
+*/
+
+typedef struct {
+  uint8_t ldrive;
+  DWORD   bootsect;
+  DWORD   fatbase;
+  DWORD   max_clust;
+} partsnap_t;
+
+typedef struct {
+  uint8_t    id[16];
+  uint8_t    realdrive;
+  uint8_t    count;     /* 0 if unused */
+  uint8_t    age;
+  partsnap_t part[CONFIG_MAX_PARTITIONS];
+} cardsnap_t;
+
+static cardsnap_t cards[CONFIG_FAST_REMOUNT_CARDS];
+static cardsnap_t pending;
+
+/* read the identification of a card, returns false if not available */
+static bool read_id(uint8_t realdrive, uint8_t *id) {
+  diskinfo1_t info;
+
+  if (disk_getinfo(realdrive, 1, &info) != RES_OK ||
+      info.validbytes < sizeof(diskinfo1_t))
+    return false;
+
+  memcpy(id, info.id, sizeof(info.id));
+  return true;
+}
+
+/**
+ * remount_restore - mount the partitions of a known card
+ * @realdrive    : physical drive number
+ * @preserve_path: preserve the current directory if non-zero
+ *
+ * This function initializes the card in @realdrive and, if its layout
+ * is known, mounts all its partitions starting at partition[max_part]
+ * at their known boot sectors. The layout is verified by parsing each
+ * boot sector again. Returns true if the card was mounted, false if
+ * the partition table must be scanned as usual.
+ */
+bool remount_restore(uint8_t realdrive, uint8_t preserve_path) {
+  uint8_t id[16];
+  uint8_t i, first = max_part;
+  cardsnap_t *card = NULL;
+
+  pending.count = 0;
+
+  if (disk_initialize(realdrive) & STA_NOINIT)
+    return false;
+
+  if (!read_id(realdrive, id))
+    return false;
+
+  for (i = 0; i < CONFIG_FAST_REMOUNT_CARDS; i++)
+    if (cards[i].count != 0 && cards[i].realdrive == realdrive &&
+        !memcmp(cards[i].id, id, sizeof(id)))
+      card = &cards[i];
+
+  if (card == NULL)
+    return false;
+
+  for (i = 0; i < card->count && max_part < CONFIG_MAX_PARTITIONS; i++) {
+    partsnap_t *ps = &card->part[i];
+    FATFS *fs = &partition[max_part].fatfs;
+
+    partition[max_part].fop = &fatops;
+    if (!preserve_path)
+      partition[max_part].current_dir.fat = 0;
+
+    if (f_mount_at(ps->ldrive, fs, ps->bootsect) != FR_OK ||
+        fs->fatbase != ps->fatbase || fs->max_clust != ps->max_clust) {
+      /* the card was changed elsewhere, forget it */
+      card->count = 0;
+      max_part = first;
+      return false;
+    }
+
+    max_part++;
+  }
+
+  /* mark as most recently used */
+  for (i = 0; i < CONFIG_FAST_REMOUNT_CARDS; i++)
+    if (cards[i].age < card->age)
+      cards[i].age++;
+  card->age = 0;
+
+  return true;
+}
+
+/**
+ * remount_add - remember a partition mounted after a scan
+ * @realdrive: physical drive number
+ * @ldrive   : logical drive number used for f_mount_at
+ * @part     : index of the partition in partition[]
+ *
+ * This function records a successfully mounted partition of the
+ * card in @realdrive for remount_save.
+ */
+void remount_add(uint8_t realdrive, uint8_t ldrive, uint8_t part) {
+  partsnap_t *ps;
+
+  if (pending.count == 0)
+    pending.realdrive = realdrive;
+
+  if (pending.realdrive != realdrive || pending.count >= CONFIG_MAX_PARTITIONS)
+    return;
+
+  ps = &pending.part[pending.count++];
+  ps->ldrive    = ldrive;
+  ps->bootsect  = partition[part].fatfs.bootsect;
+  ps->fatbase   = partition[part].fatfs.fatbase;
+  ps->max_clust = partition[part].fatfs.max_clust;
+}
+
+/**
+ * remount_save - store the layout of a completely scanned card
+ * @realdrive: physical drive number
+ *
+ * This function stores the partitions recorded by remount_add
+ * for the card in @realdrive, replacing the least recently used
+ * entry if the card is not known yet.
+ */
+void remount_save(uint8_t realdrive) {
+  uint8_t i, slot = 0;
+
+  if (pending.count == 0 || pending.realdrive != realdrive ||
+      !read_id(realdrive, pending.id)) {
+    pending.count = 0;
+    return;
+  }
+
+  for (i = 0; i < CONFIG_FAST_REMOUNT_CARDS; i++) {
+    if (cards[i].count != 0 && cards[i].realdrive == realdrive &&
+        !memcmp(cards[i].id, pending.id, sizeof(pending.id))) {
+      slot = i;
+      break;
+    }
+
+    if (cards[slot].count != 0 &&
+        (cards[i].count == 0 || cards[i].age > cards[slot].age))
+      slot = i;
+  }
+
+  for (i = 0; i < CONFIG_FAST_REMOUNT_CARDS; i++)
+    if (cards[i].age < 255)
+      cards[i].age++;
+
+  pending.age = 0;
+  memcpy(&cards[slot], &pending, sizeof(cardsnap_t));
+  pending.count = 0;
+}
@@ -0,0 +1,48 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   remount.h: Definitions for the fast remount of known cards
+
+*/
+
+#ifndef REMOUNT_H
+#define REMOUNT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef CONFIG_FAST_REMOUNT
+
+bool remount_restore(uint8_t realdrive, uint8_t preserve_path);
+void remount_add(uint8_t realdrive, uint8_t ldrive, uint8_t part);
+void remount_save(uint8_t realdrive);
+
+#else
+
+#  define remount_restore(d,p) false
+#  define remount_add(d,l,p)   do {} while (0)
+#  define remount_save(d)      do {} while (0)
+
+#endif
+
+#endif
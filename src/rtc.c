@@ -26,6 +26,7 @@
 */
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include "config.h"
 #include "ds1307-3231.h"
 #include "pcf8583.h"
@@ -33,6 +34,7 @@
 #include "rtc_lpc17xx.h"
 #include "softrtc.h"
 #include "time.h"
+#include "timer.h"
 #include "rtc.h"
 
 rtcstate_t rtc_state;
@@ -42,11 +44,63 @@ const PROGMEM struct tm rtc_default_date = {
   0, 0, 0, 31, 8-1, 82, 2
 };
 
+#ifdef NEED_RTC_CACHE
+/* Maximum age of the cached RTC reading, must stay well below half */
+/* the range of tick_t so the age check cannot wrap around.         */
+#define RTC_CACHE_TICKS (30*HZ)
+
+static struct tm cached_time;
+static tick_t    cached_ticks;
+static bool      cache_valid;
+
+/**
+ * read_rtc_cached - return the current time without reading the RTC
+ * @time: pointer to the result
+ *
+ * This function reads the RTC once and advances the time read from
+ * the system tick on subsequent calls, which is much cheaper than an
+ * I2C transaction. The RTC is read again when the cached value is
+ * older than RTC_CACHE_TICKS or the interpolated time would cross
+ * midnight, so no calendar arithmetic is required here.
+ */
+void read_rtc_cached(struct tm *time) {
+  tick_t  now = getticks();
+  uint8_t sec;
+
+  if (cache_valid && time_before(now, cached_ticks + RTC_CACHE_TICKS)) {
+    *time = cached_time;
+    sec   = time->tm_sec + (tick_t)(now - cached_ticks) / HZ;
+
+    if (sec < 60) {
+      time->tm_sec = sec;
+      return;
+    }
+
+    time->tm_sec = sec - 60;
+    if (++time->tm_min < 60)
+      return;
+
+    time->tm_min = 0;
+    if (++time->tm_hour < 24)
+      return;
+  }
+
+  read_rtc(&cached_time);
+  cached_ticks = now;
+  cache_valid  = true;
+  *time = cached_time;
+}
+
+void rtc_cache_invalidate(void) {
+  cache_valid = false;
+}
+#endif
+
 /* Return current time in a FAT-compatible format */
 uint32_t get_fattime(void) {
   struct tm time;
 
-  read_rtc(&time);
+  read_rtc_cached(&time);
   return ((uint32_t)time.tm_year-80) << 25 |
     ((uint32_t)time.tm_mon+1) << 21 |
     ((uint32_t)time.tm_mday)  << 16 |
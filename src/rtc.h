@@ -55,6 +55,17 @@ void read_rtc(struct tm *time);
 /* Set time from struct tm */
 void set_rtc(struct tm *time);
 
+#  ifdef NEED_RTC_CACHE
+/* Return current time, interpolated from a recent RTC reading */
+void read_rtc_cached(struct tm *time);
+
+/* Force the next read_rtc_cached to read the RTC again */
+void rtc_cache_invalidate(void);
+#  else
+#    define read_rtc_cached(t)     read_rtc(t)
+#    define rtc_cache_invalidate() do {} while (0)
+#  endif
+
 # else  // HAVE_RTC
 
 #  define rtc_state RTC_NOT_FOUND
@@ -30,6 +30,7 @@
 
 */
 
+#include <string.h>
 #include "config.h"
 #include "crc.h"
 #include "diskio.h"
@@ -94,6 +95,7 @@
 /* card types */
 #define CARD_MMCSD 0
 #define CARD_SDHC  1
+#define CARD_SD    2  /* accepts ACMDs, i.e. not MMC */
 
 static uint8_t cardtype[MAX_CARDS];
 
@@ -447,6 +449,8 @@ DSTATUS sd_initialize(BYTE drv) {
   if (res != 0)
     goto not_sd;
 
+  cardtype[drv] = CARD_SD;
+
   /* send READ_OCR to detect SDHC cards */
   res = send_command(drv, READ_OCR, 0);
 
@@ -456,7 +460,7 @@ DSTATUS sd_initialize(BYTE drv) {
 
     /* check card type */
     if (parameter & swap_word(0x40000000))
-      cardtype[drv] = CARD_SDHC;
+      cardtype[drv] |= CARD_SDHC;
   }
 
   deselect_card();
@@ -514,7 +518,7 @@ DRESULT sd_read(BYTE drv, BYTE *buffer, DWORD sector, BYTE count) {
     return RES_PARERR;
 
   /* convert sector number to byte offset for non-SDHC cards */
-  if (cardtype[drv] == CARD_MMCSD)
+  if (!(cardtype[drv] & CARD_SDHC))
     sector <<= 9;
 
   for (sec = 0; sec < count; sec++) {
@@ -597,6 +601,100 @@ DRESULT sd_read(BYTE drv, BYTE *buffer, DWORD sector, BYTE count) {
 DRESULT disk_read(BYTE drv, BYTE *buffer, DWORD sector, BYTE count) __attribute__ ((weak, alias("sd_read")));
 
 
+/**
+ * send_data_block - transmit a data block to the SD card
+ * @drv   : drive
+ * @token : start token for the data block
+ * @buffer: pointer to the data
+ *
+ * This function sends the start token, 512 bytes of data from buffer
+ * and the CRC of the data to the card. Returns the lower four bits of
+ * the data response token, 0x05 means that the data was accepted.
+ */
+static uint8_t send_data_block(uint8_t drv, uint8_t token, const BYTE *buffer) {
+  uint16_t crc;
+
+  spi_tx_byte(token);
+
+#ifdef CONFIG_SD_BLOCKTRANSFER
+  spi_tx_block(buffer, 512);
+  crc = crc_xmodem_block(0, buffer, 512);
+#else
+  /* interleave transfer/CRC calculations, AVR-optimized */
+  uint16_t i;
+
+  crc = 0;
+  spi_select_device(drv+1);
+  for (i=0; i<512; i++) {
+    SPDR = *buffer;
+    crc = crc_xmodem_update(crc, *buffer++);
+    loop_until_bit_is_set(SPSR, SPIF);
+  }
+#endif
+
+  /* send CRC */
+  spi_tx_byte(crc >> 8);
+  spi_tx_byte(crc & 0xff);
+
+  /* read status byte */
+  return spi_rx_byte() & 0x0f;
+}
+
+/* wait until the card has finished programming */
+static void wait_write_done(void) {
+  // FIXME: Timeout?
+  while (spi_rx_byte() == 0) ;
+}
+
+/**
+ * write_multiple - write consecutive sectors with a single command
+ * @drv    : drive
+ * @buffer : pointer to the buffer
+ * @address: card address of the first sector
+ * @count  : number of sectors to be written
+ *
+ * This function tells an SD card how many blocks will be written
+ * (SET_WR_BLK_ERASE_COUNT) so it can pre-erase them and transfers
+ * all sectors with WRITE_MULTIPLE_BLOCK. Returns 1 if successful or
+ * 0 if anything failed, the caller should write the data again
+ * one sector at a time in that case.
+ */
+static uint8_t write_multiple(BYTE drv, const BYTE *buffer, DWORD address, BYTE count) {
+  uint8_t res;
+
+  /* pre-erase hint - the card may ignore it */
+  res = send_command(drv, APP_CMD, 0);
+  deselect_card();
+  if (res <= 1) {
+    send_command(drv, SD_SET_WR_BLK_ERASE_COUNT, count);
+    deselect_card();
+  }
+
+  res = send_command(drv, WRITE_MULTIPLE_BLOCK, address);
+  if (res != 0) {
+    deselect_card();
+    return 0;
+  }
+
+  while (count--) {
+    if (send_data_block(drv, 0xfc, buffer) != 0x05) {
+      uart_putc('X');
+      res = 1;
+      break;
+    }
+    wait_write_done();
+    buffer += 512;
+  }
+
+  /* send stop transmission token, skip one byte, wait until done */
+  spi_tx_byte(0xfd);
+  spi_rx_byte();
+  wait_write_done();
+  deselect_card();
+
+  return res == 0;
+}
+
 /**
  * sd_write - writes sectors from buffer to the SD card
  * @drv   : drive
@@ -610,11 +708,11 @@ DRESULT disk_read(BYTE drv, BYTE *buffer, DWORD sector, BYTE count) __attribute_
  * if successful. Up to SD_AUTO_RETRIES will be made if the card
  * signals a CRC error. If there were errors during the command
  * transmission disk_state will be set to DISK_ERROR and no retries
- * are made.
+ * are made. Multiple sectors are written to SD cards with a single
+ * pre-erased multi-block write if possible.
  */
 DRESULT sd_write(BYTE drv, const BYTE *buffer, DWORD sector, BYTE count) {
   uint8_t  res, sec, errors;
-  uint16_t crc;
 
   if (drv >= MAX_CARDS)
     return RES_PARERR;
@@ -624,9 +722,13 @@ DRESULT sd_write(BYTE drv, const BYTE *buffer, DWORD sector, BYTE count) {
     return RES_WRPRT;
 
   /* convert sector number to byte offset for non-SDHC cards */
-  if (cardtype[drv] == CARD_MMCSD)
+  if (!(cardtype[drv] & CARD_SDHC))
     sector <<= 9;
 
+  if (count > 1 && (cardtype[drv] & CARD_SD) &&
+      write_multiple(drv, buffer, sector, count))
+    return RES_OK;
+
   for (sec = 0; sec < count; sec++) {
     errors = 0;
     while (errors < CONFIG_SD_AUTO_RETRIES) {
@@ -643,36 +745,8 @@ DRESULT sd_write(BYTE drv, const BYTE *buffer, DWORD sector, BYTE count) {
         return RES_ERROR;
       }
 
-      /* send data token */
-      spi_tx_byte(0xfe);
-
-      /* transfer data */
-#ifdef CONFIG_SD_BLOCKTRANSFER
-      spi_tx_block(buffer, 512);
-      crc = crc_xmodem_block(0, buffer, 512);
-#else
-      /* interleave transfer/CRC calculations, AVR-optimized */
-      uint16_t i;
-      const BYTE *ptr = buffer;
-
-      crc = 0;
-      spi_select_device(drv+1);
-      for (i=0; i<512; i++) {
-        SPDR = *ptr;
-        crc = crc_xmodem_update(crc, *ptr++);
-        loop_until_bit_is_set(SPSR, SPIF);
-      }
-#endif
-
-      /* send CRC */
-      spi_tx_byte(crc >> 8);
-      spi_tx_byte(crc & 0xff);
-
-      /* read status byte */
-      res = spi_rx_byte();
-
-      /* retry on error */
-      if ((res & 0x0f) != 0x05) {
+      /* transfer data, retry on error */
+      if (send_data_block(drv, 0xfe, buffer) != 0x05) {
         uart_putc('X');
         deselect_card();
         errors++;
@@ -680,10 +754,7 @@ DRESULT sd_write(BYTE drv, const BYTE *buffer, DWORD sector, BYTE count) {
       }
 
       /* wait until write is finished */
-      // FIXME: Timeout?
-      do {
-        res = spi_rx_byte();
-      } while (res == 0);
+      wait_write_done();
 
       break; // FIXME: Ugly control flow
     }
@@ -708,9 +779,9 @@ DRESULT disk_write(BYTE drv, const BYTE *buffer, DWORD sector, BYTE count) __att
  * @buffer: target buffer
  *
  * This function returns the requested information page @page
- * for card @drv in the buffer @buffer. Currently only page
- * 0 is supported which is the diskinfo0_t structure defined
- * in diskio.h. Returns a DRESULT to indicate success/failure.
+ * for card @drv in the buffer @buffer. Page 0 is the diskinfo0_t
+ * and page 1 the diskinfo1_t structure defined in diskio.h.
+ * Returns a DRESULT to indicate success/failure.
  */
 DRESULT sd_getinfo(BYTE drv, BYTE page, void *buffer) {
   uint8_t buf[18];
@@ -723,11 +794,11 @@ DRESULT sd_getinfo(BYTE drv, BYTE page, void *buffer) {
   if (sd_status(drv) & STA_NODISK)
     return RES_NOTRDY;
 
-  if (page != 0)
+  if (page > 1)
     return RES_ERROR;
 
-  /* Try to calculate the total number of sectors on the card */
-  if (send_command(drv, SEND_CSD, 0) != 0) {
+  /* Page 0 needs the CSD for the capacity, page 1 is the CID */
+  if (send_command(drv, page ? SEND_CID : SEND_CSD, 0) != 0) {
     deselect_card();
     return RES_ERROR;
   }
@@ -741,6 +812,14 @@ DRESULT sd_getinfo(BYTE drv, BYTE page, void *buffer) {
   spi_rx_block(buf, 18);
   deselect_card();
 
+  if (page == 1) {
+    diskinfo1_t *di = buffer;
+    di->validbytes  = sizeof(diskinfo1_t);
+    memcpy(di->id, buf, sizeof(di->id));
+    return RES_OK;
+  }
+
+  /* Calculate the total number of sectors on the card */
   if (cardtype[drv] & CARD_SDHC) {
     /* Special CSD for SDHC cards */
     capacity = (1 + getbits(buf,127-69,22)) * 1024;
@@ -754,6 +833,7 @@ DRESULT sd_getinfo(BYTE drv, BYTE page, void *buffer) {
 
   diskinfo0_t *di = buffer;
   di->validbytes  = sizeof(diskinfo0_t);
+  di->maxpage     = 1;
   di->disktype    = DISK_TYPE_SD;
   di->sectorsize  = 2;
   di->sectorcount = capacity;
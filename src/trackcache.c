@@ -0,0 +1,144 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   trackcache.c: Whole-track read cache for disk images
+
+*/
+#include <string.h>
+#include "config.h"
+#include "fatops.h"
+#include "trackcache.h"
+
+#define SLOT_BYTES (256L * CONFIG_TRACK_CACHE_SECTORS)
+
+typedef struct {
+  uint32_t start;
+  uint16_t bytes;  /* 0 if unused */
+  uint8_t  part;
+  uint8_t  age;
+} trackslot_t;
+
+static uint8_t     trackdata[CONFIG_TRACK_CACHE_SLOTS][SLOT_BYTES];
+static trackslot_t slots[CONFIG_TRACK_CACHE_SLOTS];
+
+/**
+ * trackcache_invalidate - drop all cached tracks of a partition
+ * @part: partition number, 0xff for all partitions
+ *
+ * This function must be called whenever the image file of a
+ * partition changes without going through image_write.
+ */
+void trackcache_invalidate(uint8_t part) {
+  for (uint8_t i = 0; i < CONFIG_TRACK_CACHE_SLOTS; i++)
+    if (part == 0xff || slots[i].part == part)
+      slots[i].bytes = 0;
+}
+
+/* mark slot as the most recently used one */
+static void touch_slot(uint8_t slot) {
+  for (uint8_t i = 0; i < CONFIG_TRACK_CACHE_SLOTS; i++)
+    if (slots[i].age < slots[slot].age)
+      slots[i].age++;
+
+  slots[slot].age = 0;
+}
+
+/**
+ * trackcache_read - read data from an image through the track cache
+ * @part   : partition number
+ * @start  : image offset of the track window containing the data
+ * @sectors: number of sectors in the track window
+ * @offset : image offset of the data
+ * @buffer : pointer to where the data should be read to
+ * @bytes  : number of bytes to read
+ *
+ * This function returns the requested data from the cache, loading
+ * the whole track window with a single read into the least recently
+ * used slot if it is not cached yet. Windows that can't be cached
+ * completely are read directly. Returns the same as image_read.
+ */
+uint8_t trackcache_read(uint8_t part, uint32_t start, uint16_t sectors,
+                        uint32_t offset, void *buffer, uint16_t bytes) {
+  uint8_t i, slot = 0;
+
+  if (sectors > CONFIG_TRACK_CACHE_SECTORS ||
+      offset < start || offset + bytes > start + 256L * sectors)
+    return image_read(part, offset, buffer, bytes);
+
+  for (i = 0; i < CONFIG_TRACK_CACHE_SLOTS; i++) {
+    if (slots[i].bytes != 0 && slots[i].part == part &&
+        slots[i].start == start)
+      break;
+
+    if (slots[slot].bytes != 0 &&
+        (slots[i].bytes == 0 || slots[i].age > slots[slot].age))
+      slot = i;
+  }
+
+  if (i == CONFIG_TRACK_CACHE_SLOTS) {
+    /* miss, read the whole window into the oldest slot */
+    slots[slot].bytes = 0;
+    if (image_read(part, start, trackdata[slot], 256 * sectors))
+      /* short or failed read, retry without the cache */
+      return image_read(part, offset, buffer, bytes);
+
+    slots[slot].part  = part;
+    slots[slot].start = start;
+    slots[slot].bytes = 256 * sectors;
+    i = slot;
+  }
+
+  touch_slot(i);
+  memcpy(buffer, trackdata[i] + (offset - start), bytes);
+  return 0;
+}
+
+/**
+ * trackcache_write - update cached data after a write to an image
+ * @part  : partition number
+ * @offset: image offset of the written data
+ * @buffer: pointer to the written data
+ * @bytes : number of bytes written
+ *
+ * This function copies data written to an image into all cached
+ * track windows it overlaps, so the cache never holds stale data.
+ */
+void trackcache_write(uint8_t part, uint32_t offset, const void *buffer, uint16_t bytes) {
+  for (uint8_t i = 0; i < CONFIG_TRACK_CACHE_SLOTS; i++) {
+    uint32_t from, to;
+
+    if (slots[i].bytes == 0 || slots[i].part != part)
+      continue;
+
+    from = offset;
+    to   = offset + bytes;
+    if (from < slots[i].start)
+      from = slots[i].start;
+    if (to > slots[i].start + slots[i].bytes)
+      to = slots[i].start + slots[i].bytes;
+
+    if (from < to)
+      memcpy(trackdata[i] + (from - slots[i].start),
+             (const uint8_t *)buffer + (from - offset), to - from);
+  }
+}
@@ -0,0 +1,47 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   trackcache.h: Definitions for the disk image track cache
+
+*/
+
+#ifndef TRACKCACHE_H
+#define TRACKCACHE_H
+
+#include <stdint.h>
+
+#ifdef CONFIG_TRACK_CACHE
+
+void    trackcache_invalidate(uint8_t part);
+uint8_t trackcache_read(uint8_t part, uint32_t start, uint16_t sectors,
+                        uint32_t offset, void *buffer, uint16_t bytes);
+void    trackcache_write(uint8_t part, uint32_t offset, const void *buffer, uint16_t bytes);
+
+#else
+
+#  define trackcache_invalidate(p)          do {} while (0)
+#  define trackcache_write(p,o,b,l)         do {} while (0)
+
+#endif
+
+#endif